@@ -8,8 +8,21 @@
 #include <linux/uaccess.h>
 #include <linux/kfifo.h>
 #include <linux/poll.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/uio.h>
+#include <linux/bitops.h>
+#include <linux/list.h>
+#include <linux/rculist.h>
+#include <linux/seq_file.h>
+#include <linux/wait_bit.h>
+#include <linux/completion.h>
 
 #include "vhw.h"
+#include "character.h"
 
 #define KEY_MESG_MAX 128
 
@@ -23,9 +36,31 @@ struct character_dev {
     struct device   *device;
 };
 
+/*
+ * every open file gets every key, in its fifo for read() or in its ring
+ * once it is mapped, a slow reader only loses its own keys
+ */
+struct character_file {
+    struct list_head        node;
+    /* the deferred ISR runs on the CPU which got the key, several at once */
+    spinlock_t              lock;
+    /* kfifo_to_user() takes one reader, mmap() allocates the ring once */
+    struct mutex            mutex;
+    wait_queue_head_t       wait;
+    uint32_t                seq;
+    unsigned long           overflow;
+    struct character_ring   *ring;
+    uint32_t                ring_head;
+    /* GPIO sends in flight, and the first one which failed since write() or fsync() reported it */
+    atomic_t                writes;
+    int                     write_err;
+    DECLARE_KFIFO(fifo, struct character_event, KEY_MESG_MAX);
+};
+
 static struct character_dev s_character_dev;
-static wait_queue_head_t s_wait_queue;
-static DEFINE_KFIFO(key_fifo, uint8_t, KEY_MESG_MAX);
+/* written under "files_mutex", walked by the ISR under RCU */
+static LIST_HEAD(s_files);
+static DEFINE_MUTEX(files_mutex);
 
 #define CONFIG_CHAR_DEBUG
 
@@ -42,7 +77,22 @@ static inline bool is_block(struct file *pfile)
 
 static int character_dev_open(struct inode *pnode, struct file *pfile)
 {
-    init_waitqueue_head(&s_wait_queue);
+    struct character_file *cfile;
+
+    cfile = kzalloc(sizeof(*cfile), GFP_KERNEL);
+    if (!cfile)
+        return -ENOMEM;
+
+    spin_lock_init(&cfile->lock);
+    mutex_init(&cfile->mutex);
+    init_waitqueue_head(&cfile->wait);
+    INIT_KFIFO(cfile->fifo);
+
+    pfile->private_data = cfile;
+
+    mutex_lock(&files_mutex);
+    list_add_tail_rcu(&cfile->node, &s_files);
+    mutex_unlock(&files_mutex);
 
     return 0;
 }
@@ -54,37 +104,246 @@ static loff_t character_dev_llseek(struct file *pfile, loff_t off, int set)
     return 0;
 }
 
+/* returns as many whole struct character_event as fit into "size" */
 static ssize_t character_dev_read(struct file *pfile, char __user *pbuf, size_t size, loff_t *off)
 {
     int ret;
-    uint8_t pdata[1];
+    unsigned int copied;
+    struct character_file *cfile = pfile->private_data;
 
-    if (is_block(pfile)) {
-        wait_event_interruptible(s_wait_queue, !kfifo_is_empty(&key_fifo));
+    if (size < sizeof(struct character_event))
+        return -EINVAL;
+
+    /* another reader of the file may take the keys first, 0 would look like EOF */
+    for (;;) {
+        if (kfifo_is_empty(&cfile->fifo)) {
+            if (!is_block(pfile))
+                return -EAGAIN;
+
+            ret = wait_event_interruptible(cfile->wait, !kfifo_is_empty(&cfile->fifo));
+            if (ret)
+                return ret;
+        }
+
+        mutex_lock(&cfile->mutex);
+        ret = kfifo_to_user(&cfile->fifo, pbuf, size, &copied);
+        mutex_unlock(&cfile->mutex);
+
+        if (ret || copied)
+            return ret ? ret : copied;
     }
-    ret = kfifo_out(&key_fifo, pdata, 1);
+}
+
+static void character_write_put(struct character_file *cfile)
+{
+    /* only the address is used for the wake up, the file may be gone already */
+    if (atomic_dec_and_test(&cfile->writes))
+        wake_up_var(&cfile->writes);
+}
+
+/* the event thread sent the bank, write() didn't wait for it */
+static void character_write_done(int ret, void *arg)
+{
+    struct character_file *cfile = arg;
 
     if (ret)
-        copy_to_user(pbuf, pdata, 1);
+        cmpxchg(&cfile->write_err, 0, ret);
+
+    character_write_put(cfile);
+}
+
+/* banks of a blocking write() in flight at once */
+#define CHARACTER_WRITE_BANKS 16
+
+struct character_write;
+
+struct character_bank {
+    struct character_write  *write;
+    size_t                  bytes;
+    int                     ret;
+};
+
+/* the banks of a blocking write(), their callbacks come in any order */
+struct character_write {
+    /* the banks in flight, and one for the writer until it waits */
+    atomic_t                pending;
+    struct completion       done;
+    unsigned int            banks;
+    struct character_bank   bank[CHARACTER_WRITE_BANKS];
+};
+
+static void character_bank_done(int ret, void *arg)
+{
+    struct character_bank *bank = arg;
+    struct character_write *write = bank->write;
+
+    bank->ret = ret;
+    if (atomic_dec_and_test(&write->pending))
+        complete(&write->done);
+}
+
+static void character_write_init(struct character_write *write)
+{
+    atomic_set(&write->pending, 1);
+    init_completion(&write->done);
+    write->banks = 0;
+}
+
+/* wait for the banks in flight, "sent" gets the bytes of the banks before the first failed one */
+static int character_write_wait(struct character_write *write, size_t *sent)
+{
+    int ret = 0;
+    unsigned int i;
+
+    if (!atomic_dec_and_test(&write->pending))
+        wait_for_completion(&write->done);
+
+    for (i = 0; i < write->banks; i++) {
+        ret = write->bank[i].ret;
+        if (ret)
+            break;
+        *sent += write->bank[i].bytes;
+    }
+
+    character_write_init(write);
 
     return ret;
 }
 
-static ssize_t character_dev_write(struct file *pfile, const char __user *pbuf, size_t size, loff_t *off)
+/*
+ * send one bank, without "write" nothing waits for it and a failed send is
+ * reported by the next write() or fsync()
+ */
+static int character_gpio_send(struct character_file *cfile, struct character_write *write,
+                               int base, uint32_t mask, uint32_t value, size_t bytes, size_t *sent)
 {
     int ret;
-    char pdata[2];
+    struct character_bank *bank;
+
+    if (!write) {
+        atomic_inc(&cfile->writes);
 
-    copy_from_user(pdata, pbuf, 2);
-    CHAR_DEBUG("\"write\" data %d %d\n", pdata[0], pdata[1]);
+        /* a non-blocking file gets -EAGAIN from a full queue */
+        ret = vhw_set_gpio_multiple_async(base, mask, value, character_write_done, cfile, GFP_NOWAIT);
+        if (ret) {
+            character_write_put(cfile);
+            return ret;
+        }
+
+        *sent += bytes;
+        return 0;
+    }
 
-    ret = vhw_set_gpio(pdata[0], pdata[1]);
+    bank = &write->bank[write->banks];
+    bank->write = write;
+    bank->bytes = bytes;
+    bank->ret = 0;
+
+    atomic_inc(&write->pending);
+
+    ret = vhw_set_gpio_multiple_async(base, mask, value, character_bank_done, bank, GFP_KERNEL);
     if (ret) {
-        CHAR_DEBUG("vhw set gpio %d\n", ret);
+        atomic_dec(&write->pending);
+        return ret;
+    }
+
+    if (++write->banks == CHARACTER_WRITE_BANKS)
+        return character_write_wait(write, sent);
+
+    return 0;
+}
+
+/*
+ * set the pins of a run of struct character_gpio, the pins of one bank go
+ * in one transfer, a pin set twice closes the transfer so both states are
+ * sent. a blocking file waits for the sends and returns the bytes of the
+ * records sent before an error, a non-blocking one returns the bytes queued
+ * and a send which fails later is reported by the next write() or fsync()
+ */
+static ssize_t character_gpio_write(struct file *pfile, struct iov_iter *from)
+{
+    int ret = 0;
+    int err;
+    int base = -1;
+    uint32_t mask = 0;
+    uint32_t value = 0;
+    size_t sent = 0;
+    size_t pending = 0;
+    struct character_gpio gpio;
+    struct character_write write;
+    struct character_write *pwrite = NULL;
+    struct character_file *cfile = pfile->private_data;
+
+    if (iov_iter_count(from) < sizeof(gpio))
+        return -EINVAL;
+
+    ret = xchg(&cfile->write_err, 0);
+    if (ret)
         return ret;
+
+    if (is_block(pfile)) {
+        character_write_init(&write);
+        pwrite = &write;
     }
 
-    return 2;
+    while (iov_iter_count(from) >= sizeof(gpio)) {
+        int bank;
+        uint32_t bit;
+
+        if (copy_from_iter(&gpio, sizeof(gpio), from) != sizeof(gpio)) {
+            ret = -EFAULT;
+            break;
+        }
+
+        bank = gpio.pin & ~31;
+        bit = BIT(gpio.pin & 31);
+
+        if (mask && (bank != base || (mask & bit))) {
+            ret = character_gpio_send(cfile, pwrite, base, mask, value, pending, &sent);
+            if (ret)
+                break;
+
+            pending = 0;
+            mask = 0;
+            value = 0;
+        }
+
+        base = bank;
+        mask |= bit;
+        if (gpio.state)
+            value |= bit;
+        pending += sizeof(gpio);
+    }
+
+    if (!ret && mask)
+        ret = character_gpio_send(cfile, pwrite, base, mask, value, pending, &sent);
+
+    /* a bank in flight failed before the error of this pass */
+    if (pwrite) {
+        err = character_write_wait(pwrite, &sent);
+        if (err)
+            ret = err;
+    }
+
+    if (ret)
+        CHAR_DEBUG("vhw set gpio %d, %zu bytes sent\n", ret, sent);
+
+    return sent ? sent : ret;
+}
+
+static ssize_t character_dev_write(struct file *pfile, const char __user *pbuf, size_t size, loff_t *off)
+{
+    int ret;
+    struct iovec iov;
+    struct iov_iter iter;
+
+    ret = import_single_range(WRITE, (char __user *)pbuf, size, &iov, &iter);
+    if (ret)
+        return ret;
+
+    CHAR_DEBUG("\"write\" %zu GPIO records\n", size / sizeof(struct character_gpio));
+
+    return character_gpio_write(pfile, &iter);
 }
 
 static ssize_t character_dev_read_iter(struct kiocb *kiocb, struct iov_iter *iov_iter)
@@ -94,11 +353,12 @@ static ssize_t character_dev_read_iter(struct kiocb *kiocb, struct iov_iter *iov
     return 0;
 }
 
+/* writev(), the records may be split across the vectors */
 static ssize_t character_dev_write_iter(struct kiocb *kiocb, struct iov_iter *iov_iter)
 {
-    printk("character device testing module \"write_iter\"\n");
+    CHAR_DEBUG("\"write_iter\" %zu GPIO records\n", iov_iter_count(iov_iter) / sizeof(struct character_gpio));
 
-    return 0;
+    return character_gpio_write(kiocb->ki_filp, iov_iter);
 }
 
 static int character_dev_iterate(struct file *pfile, struct dir_context *pdir)
@@ -108,13 +368,20 @@ static int character_dev_iterate(struct file *pfile, struct dir_context *pdir)
     return 0;
 }
 
+static bool character_ring_empty(struct character_file *cfile)
+{
+    return READ_ONCE(cfile->ring_head) == READ_ONCE(cfile->ring->tail);
+}
+
+/* a file which mapped the ring waits for the ring, the others for read() */
 static unsigned int character_dev_poll(struct file *pfile, struct poll_table_struct *poll_table)
 {
     unsigned int mask = 0;
+    struct character_file *cfile = pfile->private_data;
 
-    poll_wait(pfile, &s_wait_queue, poll_table);
+    poll_wait(pfile, &cfile->wait, poll_table);
 
-    if (!kfifo_is_empty(&key_fifo))
+    if (READ_ONCE(cfile->ring) ? !character_ring_empty(cfile) : !kfifo_is_empty(&cfile->fifo))
         mask |= POLLIN | POLLRDNORM;
 
     return mask;
@@ -134,11 +401,48 @@ static long character_dev_compat_ioctl(struct file *pfile, unsigned int cmd, uns
     return 0;
 }
 
+/*
+ * map the event ring of the file, user space writes "tail" so the mapping
+ * is writable. the mapping holds the file, the ring goes at release
+ */
 static int character_dev_mmap(struct file *pfile, struct vm_area_struct *vm_area)
 {
-    printk("character device testing module \"mmap\"\n");
+    int ret = 0;
+    struct character_ring *ring;
+    struct character_file *cfile = pfile->private_data;
+
+    if (vm_area->vm_pgoff || vm_area->vm_end - vm_area->vm_start > CHARACTER_RING_SIZE)
+        return -EINVAL;
+
+    mutex_lock(&cfile->mutex);
+
+    ring = cfile->ring;
+    if (!ring) {
+        ring = vmalloc_user(CHARACTER_RING_SIZE);
+        if (!ring) {
+            ret = -ENOMEM;
+            goto out;
+        }
+    }
 
-    return 0;    
+    ret = remap_vmalloc_range(vm_area, ring, 0);
+    if (ret) {
+        if (!cfile->ring)
+            vfree(ring);
+        goto out;
+    }
+
+    /* the keys go to the ring from now on */
+    if (!cfile->ring) {
+        spin_lock_irq(&cfile->lock);
+        cfile->ring = ring;
+        spin_unlock_irq(&cfile->lock);
+    }
+
+out:
+    mutex_unlock(&cfile->mutex);
+
+    return ret;
 }
 
 static int character_dev_flush(struct file *pfile, fl_owner_t id)
@@ -150,16 +454,30 @@ static int character_dev_flush(struct file *pfile, fl_owner_t id)
 
 static int character_dev_release(struct inode *pnode, struct file *pfile)
 {
-    printk("character device testing module \"release\"\n");
+    struct character_file *cfile = pfile->private_data;
 
-    return 0; 
+    mutex_lock(&files_mutex);
+    list_del_rcu(&cfile->node);
+    mutex_unlock(&files_mutex);
+
+    /* wait for the ISRs which may still fill it, and for the GPIO sends */
+    synchronize_rcu();
+    wait_var_event(&cfile->writes, !atomic_read(&cfile->writes));
+
+    vfree(cfile->ring);
+    kfree(cfile);
+
+    return 0;
 }
 
+/* wait for the GPIO sends of the file, it reports the first one which failed */
 static int character_dev_fsync(struct file *pfile, loff_t off1, loff_t off2, int datasync)
 {
-    printk("character device testing module \"fsync\"\n");
+    struct character_file *cfile = pfile->private_data;
 
-    return 0; 
+    wait_var_event(&cfile->writes, !atomic_read(&cfile->writes));
+
+    return xchg(&cfile->write_err, 0);
 }
 
 static int character_dev_fasync(int index, struct file *pfile, int signal)
@@ -232,9 +550,16 @@ static long character_dev_fallocate(struct file *pfile, int mode, loff_t offset,
     return 0; 
 }
 
+/* /proc/<pid>/fdinfo/<fd> shows the queue of the file */
 static void character_dev_show_fdinfo(struct seq_file *m, struct file *f)
 {
-    printk("character device testing module \"show_fdinfo\"\n");
+    struct character_file *cfile = f->private_data;
+
+    seq_printf(m, "keys:\t%u\n", READ_ONCE(cfile->seq));
+    seq_printf(m, "queued:\t%u\n", kfifo_len(&cfile->fifo));
+    seq_printf(m, "overflow:\t%lu\n", READ_ONCE(cfile->overflow));
+    seq_printf(m, "ring:\t%s\n", READ_ONCE(cfile->ring) ? "mapped" : "none");
+    seq_printf(m, "writes:\t%d\n", atomic_read(&cfile->writes));
 }
 
 static struct file_operations character_dev_fs = {
@@ -266,18 +591,58 @@ static struct file_operations character_dev_fs = {
     .release = character_dev_release,
 };
 
-static void character_dev_isr(int id, int val, void *arg)
+/* called under the file lock, "tail" comes from user space and isn't trusted */
+static bool character_ring_put(struct character_file *cfile, const struct character_event *event)
 {
-    int ret;
-    uint8_t key = id;
+    struct character_ring *ring = cfile->ring;
+    uint32_t tail = smp_load_acquire(&ring->tail);
 
-    ret = kfifo_in(&key_fifo, &key, sizeof(key));
-    if (ret <= 0) {
-        printk("in fifo error %d\n", ret);
+    if (cfile->ring_head - tail >= CHARACTER_RING_EVENTS) {
+        ring->overflow++;
+        return false;
     }
-    wake_up(&s_wait_queue);
 
-    printk("ID is %d, val is %d, arg is %p\n", id, val, arg);
+    ring->events[cfile->ring_head & (CHARACTER_RING_EVENTS - 1)] = *event;
+    WRITE_ONCE(cfile->ring_head, cfile->ring_head + 1);
+    smp_store_release(&ring->head, cfile->ring_head);
+
+    return true;
+}
+
+static void character_file_put(struct character_file *cfile, struct character_event *event)
+{
+    bool ret;
+    unsigned long flags;
+
+    spin_lock_irqsave(&cfile->lock, flags);
+    /* a full queue still uses up the sequence, the reader sees the gap */
+    event->seq = cfile->seq;
+    WRITE_ONCE(cfile->seq, cfile->seq + 1);
+    if (cfile->ring)
+        ret = character_ring_put(cfile, event);
+    else
+        ret = kfifo_put(&cfile->fifo, *event);
+    if (!ret)
+        WRITE_ONCE(cfile->overflow, cfile->overflow + 1);
+    spin_unlock_irqrestore(&cfile->lock, flags);
+
+    wake_up(&cfile->wait);
+}
+
+static void character_dev_isr(int id, int val, void *arg)
+{
+    struct character_file *cfile;
+    struct character_event event = {
+        .id = id,
+        .val = val,
+        .ns = ktime_get_ns(),
+    };
+
+    /* only the lock of each file is taken, readers don't contend with each other */
+    rcu_read_lock();
+    list_for_each_entry_rcu(cfile, &s_files, node)
+        character_file_put(cfile, &event);
+    rcu_read_unlock();
 }
 
 __init static int character_dev_init(void)
@@ -291,8 +656,11 @@ __init static int character_dev_init(void)
 
     printk("character device testing module initialize start\n");
 
+    BUILD_BUG_ON(sizeof(struct character_ring) > CHARACTER_RING_SIZE);
+
     for (i = CHARACTER_IRQ_BASE; i < CHARACTER_IRQ_BASE + CHARACTER_IRQ_MAX; i++) {
-        ret = vhw_register_irq(i, character_dev_isr, NULL);
+        /* the ISR walks every open file, keep it out of the receive thread */
+        ret = vhw_register_irq_flags(i, character_dev_isr, NULL, VHW_IRQF_DEFERRED);
         if (ret)
             goto irq_fail;
     }
@@ -343,7 +711,7 @@ cdev_fail:
     printk("cdev fail\n");
 irq_fail:
     printk("IRQ fail\n");
-    while (--i >= 0)
+    while (--i >= CHARACTER_IRQ_BASE)
         vhw_unregister_irq(i);
 
     return -ENOMEM;
@@ -0,0 +1,48 @@
+#ifndef _CHARACTER_H_
+#define _CHARACTER_H_
+
+/* shared by the driver and its user space test */
+
+#include <linux/types.h>
+
+/* record returned by read() on /dev/character, reads take whole records */
+struct character_event {
+    __u32 id;           /* IRQ id of the key */
+    __s32 val;          /* IRQ value sent by the board */
+    __u64 ns;           /* CLOCK_MONOTONIC time the driver got the key */
+    __u32 seq;          /* increases by one per key of the open file, a gap is a lost key */
+    __u32 reserved;
+};
+
+/*
+ * record written to /dev/character, write() and writev() take arrays of
+ * them, the pins of one 32 pin bank are set by one transfer
+ */
+struct character_gpio {
+    __u8 pin;
+    __u8 state;
+};
+
+/* mmap() length of the event ring, offset 0 */
+#define CHARACTER_RING_SIZE     8192
+/* records in the ring, power of 2 */
+#define CHARACTER_RING_EVENTS   256
+
+/*
+ * event ring shared with user space by mmap(), every open file has its own
+ * and gets its keys there instead of read() once it is mapped. the driver
+ * writes the record at "head" then moves "head" with release order, user
+ * space reads the records from "tail" to "head" after an acquire load of
+ * "head" and moves "tail" with release order. poll() only has to be called
+ * when the ring is empty, it sleeps until "head" moves
+ */
+struct character_ring {
+    __u32 head;         /* next record written by the driver */
+    __u32 overflow;     /* records lost on a full ring */
+    __u8  pad1[56];
+    __u32 tail;         /* next record read by user space, only written by user space */
+    __u8  pad2[60];
+    struct character_event events[CHARACTER_RING_EVENTS];
+};
+
+#endif
@@ -5,6 +5,38 @@
 #include <errno.h>
 #include <stdbool.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <poll.h>
+
+#include "character.h"
+
+#define EVENT_MAX 16
+
+/* toggle the LED of a key */
+static void key_event(int fd, const struct character_event *event, bool *led)
+{
+    int ret;
+    struct character_gpio gpio;
+    int offset = event->id - 5;
+
+    printf("Read Key %u val %d seq %u time %llu\n", event->id, event->val, event->seq,
+           (unsigned long long)event->ns);
+
+    if (event->id < 5 || event->id > 8)
+        return;
+
+    led[offset] = !led[offset];
+
+    gpio.pin = offset;
+    gpio.state = led[offset];
+
+    ret = write(fd, &gpio, sizeof(gpio));
+    if (ret <= 0) {
+        printf("write error %d\n", ret);
+    } else {
+        printf("set LED %d state %d\n", gpio.pin, led[offset]);
+    }
+}
 
 #if 0
 
@@ -12,7 +44,7 @@ int main(int argc, char *argv[])
 {
     int ret;
     int fd;
-    char key;
+    struct character_event events[EVENT_MAX];
     bool led[4];
 
     fd = open("/dev/character", O_RDWR);
@@ -23,25 +55,14 @@ int main(int argc, char *argv[])
         led[i] = false;
 
     while (1) {
-        ret = read(fd, &key, sizeof(key));
+        ret = read(fd, events, sizeof(events));
         if (ret <= 0) {
-            printf("read error %d\n", key);
-        }
-        
-        if (key >= 5 && key <= 8) {
-            char buf[2];
-            int offset = key - 5;
-            
-            led[offset] = !led[offset];
-
-            buf[0] = offset;
-            buf[1] = led[offset];
-
-            ret = write(fd, buf, sizeof(buf));
-            if (ret <= 0) {
-                printf("write error %d\n", key);
-            }
+            printf("read error %d\n", errno);
+            continue;
         }
+
+        for (int i = 0; i < ret / sizeof(events[0]); i++)
+            key_event(fd, &events[i], led);
     }
 
     close(fd);
@@ -55,11 +76,58 @@ open_fail:
 
 #else
 
+/* "test mmap" takes the keys from the shared ring, poll() only sleeps */
+static int ring_main(int fd, bool *led)
+{
+    int ret;
+    unsigned int head;
+    unsigned int tail;
+    struct character_ring *ring;
+
+    ring = mmap(NULL, CHARACTER_RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ring == MAP_FAILED) {
+        printf("mmap error %d\n", errno);
+        return -1;
+    }
+
+    tail = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+    while (1) {
+        struct pollfd pfd = {
+            .fd = fd,
+            .events = POLLIN
+        };
+
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            ret = poll(&pfd, 1, 10000);
+            if (ret < 0) {
+                printf("poll error %d\n", errno);
+                break;
+            } else if (ret == 0) {
+                printf("poll timeout 10s, %u keys lost\n", ring->overflow);
+            }
+            continue;
+        }
+
+        while (tail != head) {
+            key_event(fd, &ring->events[tail % CHARACTER_RING_EVENTS], led);
+            tail++;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    munmap(ring, CHARACTER_RING_SIZE);
+
+    return -1;
+}
+
 int main(int argc, char *argv[])
 {
     int ret;
     int fd;
-    char key;
+    struct character_event events[EVENT_MAX];
     bool led[4];
 
     fd = open("/dev/character", O_RDWR | O_NONBLOCK);
@@ -69,6 +137,12 @@ int main(int argc, char *argv[])
     for (int i = 0; i < 4; i++)
         led[i] = false;
 
+    if (argc > 1 && !strcmp(argv[1], "mmap")) {
+        ret = ring_main(fd, led);
+        close(fd);
+        return ret;
+    }
+
     while (1) {
         fd_set rfds;
         fd_set efds;
@@ -100,28 +174,15 @@ int main(int argc, char *argv[])
             continue;
         }
 
-        ret = read(fd, &key, sizeof(key));
+        /* one read takes every pending key */
+        ret = read(fd, events, sizeof(events));
         if (ret <= 0) {
-            printf("read error %d\n", key);
-        }
-        printf("Read Key %d\n", key);
-        
-        if (key >= 5 && key <= 8) {
-            char buf[2];
-            int offset = key - 5;
-            
-            led[offset] = !led[offset];
-
-            buf[0] = offset;
-            buf[1] = led[offset];
-
-            ret = write(fd, buf, sizeof(buf));
-            if (ret <= 0) {
-                printf("write error %d\n", ret);
-            } else {
-                printf("set LED %d state %d\n", buf[0], led[offset]);
-            }
+            printf("read error %d\n", errno);
+            continue;
         }
+
+        for (int i = 0; i < ret / sizeof(events[0]); i++)
+            key_event(fd, &events[i], led);
     }
 
     close(fd);
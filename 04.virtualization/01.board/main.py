@@ -1,10 +1,28 @@
 #!/usr/bin/python3.5
 
-import sys, platform, time, random, serial, socket
+import sys, platform, time, random, serial, socket, struct
 from PyQt5 import QtCore, QtGui, QtWidgets, Qt
 
 import board
 
+# binary frame protocol, see 02.module/vhw_proto.h
+VHW_PROTO_MAGIC   = 0x5648
+VHW_PROTO_VERSION = 1
+VHW_FRAME_HDR     = struct.Struct("!HBBHHI")
+VHW_FRAME_REC     = struct.Struct("!HHII")
+VHW_REC_GPIO      = 1
+VHW_REC_IRQ       = 2
+VHW_REC_GPIO_MULTI = 3
+VHW_REC_DMA_ACK   = 4
+VHW_REC_ACK       = 5
+VHW_FRAME_F_DMA   = 1
+VHW_FRAME_F_RELIABLE = 2
+VHW_FRAME_F_RESYNC = 4
+VHW_RELIABLE_WINDOW = 256
+VHW_DMA_FRAG      = struct.Struct("!HHIIIIHH")
+VHW_DMA_FRAG_FIRST = 1
+VHW_DMA_WINDOW    = 32
+
 class board(board.Ui_MainWindow):
     def __init__(self, port=14212, using_str=False):
         super(board, self).__init__()
@@ -16,6 +34,11 @@ class board(board.Ui_MainWindow):
 
         self.port = port
         self.using_str = using_str
+        self.seq = 0
+        # next DMA fragment sequence expected on each channel
+        self.dma_expect = {}
+        # next reliable record sequence expected
+        self.rel_expect = 0
 
         self.board_init()
 
@@ -23,6 +46,9 @@ class board(board.Ui_MainWindow):
         sys.exit(app.exec_())
 
     def event_msg(self, id, val):
+        if not self.using_str:
+            return self.frame_msg(((VHW_REC_IRQ, id, val, 0),))
+
         data = Qt.QByteArray()
 
         s_val = "%04d" % val
@@ -33,6 +59,16 @@ class board(board.Ui_MainWindow):
 
         return data
 
+    def frame_msg(self, records):
+        data = VHW_FRAME_HDR.pack(VHW_PROTO_MAGIC, VHW_PROTO_VERSION, 0,
+                                  len(records), 0, self.seq)
+        self.seq = (self.seq + 1) & 0xffffffff
+
+        for rec in records:
+            data += VHW_FRAME_REC.pack(*rec)
+
+        return Qt.QByteArray(data)
+
     def button_event(self, val):
         self.udp.writeDatagram(self.event_msg(val, 1), self.remote_addr, self.remote_port)
 
@@ -70,15 +106,74 @@ class board(board.Ui_MainWindow):
         return v
 
     def recv_udp(self):
-        event = self.udp.readDatagram(12)[0]
-        if len(event) < 12:
+        while self.udp.hasPendingDatagrams():
+            size = self.udp.pendingDatagramSize()
+            event = bytes(self.udp.readDatagram(size)[0])
+
+            if len(event) >= VHW_FRAME_HDR.size:
+                magic, version, flags, count, _, seq = VHW_FRAME_HDR.unpack_from(event)
+                if magic == VHW_PROTO_MAGIC:
+                    if version == VHW_PROTO_VERSION and flags & VHW_FRAME_F_DMA:
+                        self.recv_dma(event)
+                    elif version == VHW_PROTO_VERSION:
+                        first = 0
+                        if flags & VHW_FRAME_F_RELIABLE:
+                            first = self.recv_reliable(flags, count, seq)
+                        self.recv_frame(event, count, first)
+                    continue
+
+            # a batched datagram carries several 12 bytes events back to back
+            for off in range(0, len(event) - 11, 12):
+                _id  = self.get_obj(event, off, 4)
+                _num = self.get_obj(event, off + 4, 4)
+                _val = self.get_obj(event, off + 8, 4)
+
+                self.event_handle(_id, _num, _val)
+
+    def recv_reliable(self, flags, count, seq):
+        # records are taken in order, the ones already received are skipped
+        first = (self.rel_expect - seq) & 0xffffffff
+        if flags & VHW_FRAME_F_RESYNC:
+            first = 0
+
+        if first > count:
+            first = count
+        else:
+            self.rel_expect = (seq + count) & 0xffffffff
+
+        ack = self.frame_msg(((VHW_REC_ACK, 0, self.rel_expect, VHW_RELIABLE_WINDOW),))
+        self.udp.writeDatagram(ack, self.remote_addr, self.remote_port)
+
+        return first
+
+    def recv_frame(self, event, count, first=0):
+        off = VHW_FRAME_HDR.size + first * VHW_FRAME_REC.size
+        for i in range(first, count):
+            if off + VHW_FRAME_REC.size > len(event):
+                break
+
+            _type, _num, _val, _arg = VHW_FRAME_REC.unpack_from(event, off)
+            off += VHW_FRAME_REC.size
+
+            if _type == VHW_REC_GPIO:
+                self.event_handle(_type, _num, _val)
+            elif _type == VHW_REC_GPIO_MULTI:
+                # one bank update, "_val" selects the LEDs and "_arg" holds their states
+                for bit in range(32):
+                    if _val & (1 << bit):
+                        self.event_handle(VHW_REC_GPIO, _num + bit, 1 if _arg & (1 << bit) else 0)
+
+    def recv_dma(self, event):
+        # a DMA sink, in order fragments are counted and acknowledged, the data is dropped
+        if len(event) < VHW_FRAME_HDR.size + VHW_DMA_FRAG.size:
             return
 
-        _id  = self.get_obj(event, 0, 4)
-        _num = self.get_obj(event, 4, 4)
-        _val = self.get_obj(event, 8, 4)
+        chan, flags, xfer, seq, offset, total, length, _ = VHW_DMA_FRAG.unpack_from(event, VHW_FRAME_HDR.size)
+        if seq == self.dma_expect.get(chan) or flags & VHW_DMA_FRAG_FIRST:
+            self.dma_expect[chan] = (seq + 1) & 0xffffffff
 
-        self.event_handle(_id, _num, _val)
+        ack = self.frame_msg(((VHW_REC_DMA_ACK, chan, self.dma_expect.get(chan, 0), VHW_DMA_WINDOW),))
+        self.udp.writeDatagram(ack, self.remote_addr, self.remote_port)
 
     def set_led(self, num, state):
         num_tup = (self.textLed1, self.textLed2, self.textLed3, self.textLed4)
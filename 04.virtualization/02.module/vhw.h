@@ -4,7 +4,7 @@
 #include "vhw_def.h"
 
 /*
- * @bref virtual hardware set UDP data
+ * @bref virtual hardware set UDP data, it is sent as a datagram of its own
  *
  * @param buffer data point
  * @param n data size
@@ -15,6 +15,30 @@
  */
 int vhw_send_data(const void *buffer, int n);
 
+/*
+ * @bref virtual hardware submit UDP data without waiting for it to be sent,
+ *       the data is copied so the buffer can be reused at once. data goes
+ *       through the bulk lane, gpio updates submitted after it may be sent first.
+ *       every call is sent as a datagram of its own, it is never batched
+ *
+ * @param buffer data point
+ * @param n data size, no more than VHW_DATA_MAX, above VHW_EVENT_DATA_MAX the
+ *          data is copied into a preallocated per-CPU buffer
+ * @param done callback called from the event thread after sending, can be NULL
+ * @param arg callback argument
+ * @param gfp GFP_KERNEL lets the "block" queue_policy wait for a free slot,
+ *            GFP_ATOMIC or GFP_NOWAIT returns -EAGAIN instead, for a caller
+ *            which holds a lock or can't sleep
+ * 
+ * @return the result
+ *       0 : OK
+ * -ENOBUFS : no free buffer in the pool of this CPU
+ *  -EAGAIN : the queue is full
+ *   other : fail
+ */
+int vhw_submit_data(const void *buffer, int n, void (*done)(int ret, void *arg), void *arg,
+                    gfp_t gfp);
+
 /*
  * @bref virtual hardware set gpio state
  *
@@ -27,21 +51,101 @@ int vhw_send_data(const void *buffer, int n);
  */
 int vhw_set_gpio(int gpio, bool set);
 
+/*
+ * @bref virtual hardware set gpio state without waiting for it to be sent
+ *
+ * @param gpio gpio number
+ * @param set gpio state
+ * @param done callback called from the event thread after sending, or after the
+ *             board acknowledged it with the "reliable" module parameter, can be NULL
+ * @param arg callback argument
+ * @param gfp GFP_KERNEL lets the "block" queue_policy wait for a free slot,
+ *            GFP_ATOMIC or GFP_NOWAIT returns -EAGAIN instead, for a caller
+ *            which holds a lock or can't sleep
+ * 
+ * @return the result
+ *       0 : OK
+ *  -EAGAIN : the queue is full
+ *   other : fail
+ */
+int vhw_set_gpio_async(int gpio, bool set, void (*done)(int ret, void *arg), void *arg,
+                       gfp_t gfp);
+
+/*
+ * @bref virtual hardware set the state of up to 32 gpios with one event,
+ *       the board applies them all at once
+ *
+ * @param base first gpio number
+ * @param mask bit N selects gpio "base + N"
+ * @param value bit N is the state of gpio "base + N"
+ * 
+ * @return the result
+ *       0 : OK
+ *   other : fail
+ */
+int vhw_set_gpio_multiple(int base, uint32_t mask, uint32_t value);
+
+/*
+ * @bref virtual hardware set the state of up to 32 gpios without waiting
+ *       for it to be sent
+ *
+ * @param base first gpio number
+ * @param mask bit N selects gpio "base + N"
+ * @param value bit N is the state of gpio "base + N"
+ * @param done callback called from the event thread after sending, or after the
+ *             board acknowledged it with the "reliable" module parameter, can be NULL
+ * @param arg callback argument
+ * @param gfp GFP_KERNEL lets the "block" queue_policy wait for a free slot,
+ *            GFP_ATOMIC or GFP_NOWAIT returns -EAGAIN instead, for a caller
+ *            which holds a lock or can't sleep
+ * 
+ * @return the result
+ *       0 : OK
+ *  -EAGAIN : the queue is full
+ *   other : fail
+ */
+int vhw_set_gpio_multiple_async(int base, uint32_t mask, uint32_t value,
+                                void (*done)(int ret, void *arg), void *arg, gfp_t gfp);
+
 /*
  * @bref virtual hardware register a IRQ
  *
  * @param id id number
- * @param func IRQ callback function
+ * @param func IRQ callback function, it can sleep but must not unregister
+ *             its own IRQ
  * @arg 
  * 
  * @return the result
  *       0 : OK
+ * -EBUSY  : the id already has a handler
  *   other : fail
  */
 int vhw_register_irq(int id, void (*func)(int id, int val, void *arg), void *arg);
 
 /*
- * @bref virtual hardware unregister a IRQ
+ * @bref virtual hardware register a IRQ with flags
+ *
+ * @param id id number
+ * @param func IRQ callback function
+ * @param arg callback argument
+ * @param flags VHW_IRQF_* flags, 0 runs the callback inline in the receive
+ *              thread like vhw_register_irq, VHW_IRQF_DEFERRED runs it from
+ *              a per-CPU workqueue so a slow callback doesn't stall reception,
+ *              VHW_IRQF_ATOMIC lets the "callback" receive mode run it inline
+ *              from the socket callback, without it the callback is deferred
+ *              in that mode
+ * 
+ * @return the result
+ *       0 : OK
+ * -EBUSY  : the id already has a handler
+ *   other : fail
+ */
+int vhw_register_irq_flags(int id, void (*func)(int id, int val, void *arg), void *arg,
+                           unsigned int flags);
+
+/*
+ * @bref virtual hardware unregister a IRQ, it returns after the running
+ *       callback of the IRQ has finished
  *
  * @param id id number
  * 
@@ -49,4 +153,73 @@ int vhw_register_irq(int id, void (*func)(int id, int val, void *arg), void *arg
  */
 void vhw_unregister_irq(int id);
 
+/*
+ * @bref virtual hardware start a DMA transfer on a channel, the transfers
+ *       of one channel and direction are done one after another in the
+ *       order they were submitted
+ *
+ * @param chan DMA channel, less than VHW_DMA_CHAN_MAX
+ * @param xfer transfer, "dir", "sgl", "nents", "len" and "done" must be set,
+ *             it must stay valid until "done" is called from a DMA worker or
+ *             the receive thread with the number of bytes moved
+ * 
+ * @return the result
+ *       0 : OK, "done" will be called
+ * -EPROTONOSUPPORT : the legacy wire format has no DMA
+ *   other : fail
+ */
+int vhw_dma_submit(int chan, struct vhw_dma_xfer *xfer);
+
+/*
+ * @bref virtual hardware DMA transfer, it waits for the transfer to finish
+ *
+ * @param chan DMA channel, less than VHW_DMA_CHAN_MAX
+ * @param dir VHW_DMA_TO_BOARD or VHW_DMA_FROM_BOARD
+ * @param sgl scatter-gather list
+ * @param nents number of entries in the list
+ * @param len bytes to send, or room in the list for the received ones
+ * 
+ * @return the number of bytes moved, negative error code on fail
+ */
+ssize_t vhw_dma_transfer(int chan, int dir, struct scatterlist *sgl, unsigned int nents, size_t len);
+
+/*
+ * @bref virtual hardware abort all the DMA transfers of a channel, their
+ *       callbacks get -ECANCELED before it returns
+ *
+ * @param chan DMA channel
+ * 
+ * @return none
+ */
+void vhw_dma_terminate(int chan);
+
+/*
+ * @bref virtual hardware start a timer which raises the IRQ "id", register
+ *       the handler with vhw_register_irq(), its value is the number of
+ *       periods elapsed since the last call. an expired one-shot timer can
+ *       be started again, also from its handler
+ *
+ * @param id IRQ id
+ * @param period_ns period or delay in nanoseconds, at least VHW_TIMER_PERIOD_MIN
+ * @param periodic true fires every period, false fires once
+ * 
+ * @return the result
+ *       0 : OK
+ * -EBUSY  : a timer is running with the id
+ * -ESHUTDOWN : the timer of the id is being stopped
+ * -ENOSPC : all VHW_TIMER_MAX timers are used
+ *   other : fail
+ */
+int vhw_timer_start(int id, u64 period_ns, bool periodic);
+
+/*
+ * @bref virtual hardware stop and free the timer of the IRQ "id", it must
+ *       not be called from the handler of that IRQ
+ *
+ * @param id IRQ id
+ * 
+ * @return none
+ */
+void vhw_timer_stop(int id);
+
 #endif /* _VHW_H_ */
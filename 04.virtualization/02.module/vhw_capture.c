@@ -0,0 +1,308 @@
+#include <linux/kfifo.h>
+#include <linux/vmalloc.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/sched.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/slab.h>
+#include <linux/fs.h>
+#include <linux/uaccess.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/moduleparam.h>
+#include <linux/module.h>
+#include <linux/errno.h>
+
+#include "vhw_priv.h"
+#include "vhw_capture.h"
+
+/* capture buffer records, power of 2 */
+static unsigned int capture_size = 16384;
+/* replay with the captured gaps between the records, 0 replays as fast as possible */
+static bool replay_timing = true;
+
+module_param(capture_size, uint, S_IRUGO);
+module_param(replay_timing, bool, S_IRUGO | S_IWUSR);
+
+struct vhw_capture_stats {
+    u64                     captured;
+    u64                     lost;
+    u64                     replayed;
+    u64                     skipped;    /* replayed records which aren't received IRQs */
+};
+
+struct vhw_replay {
+    struct vhw_capture_rec  rec;
+    size_t                  partial;    /* bytes of "rec" written so far */
+    bool                    started;
+    u64                     first_ns;   /* capture time of the first record */
+    u64                     start_ns;   /* replay time of the first record */
+};
+
+bool vhw_capture_on;
+static DEFINE_SPINLOCK(capture_lock);
+static DECLARE_KFIFO_PTR(capture_fifo, struct vhw_capture_rec);
+static void *capture_buf;
+static DECLARE_WAIT_QUEUE_HEAD(capture_wq);
+static atomic_t capture_opened = ATOMIC_INIT(0);
+static struct vhw_capture_stats capture_stats;
+static struct dentry *capture_dentry;
+static struct dentry *replay_dentry;
+static struct dentry *capture_stats_dentry;
+
+void __vhw_capture(int dir, int type, int id, uint32_t val, uint32_t arg, u64 ns)
+{
+    unsigned long flags;
+    struct vhw_capture_rec rec = {
+        .ns = ns,
+        .dir = dir,
+        .type = type,
+        .id = id,
+        .val = val,
+        .arg = arg,
+    };
+
+    /* called from the receive threads and the event thread at once */
+    spin_lock_irqsave(&capture_lock, flags);
+    if (vhw_capture_on) {
+        if (kfifo_put(&capture_fifo, rec))
+            capture_stats.captured++;
+        else
+            capture_stats.lost++;
+    }
+    spin_unlock_irqrestore(&capture_lock, flags);
+
+    if (wq_has_sleeper(&capture_wq))
+        wake_up(&capture_wq);
+}
+
+static int vhw_capture_open(struct inode *pnode, struct file *pfile)
+{
+    size_t size = roundup_pow_of_two(max(capture_size, 2U)) * sizeof(struct vhw_capture_rec);
+    int ret;
+
+    /* the buffer has one consumer */
+    if (atomic_cmpxchg(&capture_opened, 0, 1))
+        return -EBUSY;
+
+    capture_buf = vmalloc(size);
+    if (!capture_buf) {
+        atomic_set(&capture_opened, 0);
+        return -ENOMEM;
+    }
+
+    ret = kfifo_init(&capture_fifo, capture_buf, size);
+    if (ret) {
+        vfree(capture_buf);
+        atomic_set(&capture_opened, 0);
+        return ret;
+    }
+
+    spin_lock_irq(&capture_lock);
+    vhw_capture_on = true;
+    spin_unlock_irq(&capture_lock);
+
+    return nonseekable_open(pnode, pfile);
+}
+
+static int vhw_capture_release(struct inode *pnode, struct file *pfile)
+{
+    spin_lock_irq(&capture_lock);
+    vhw_capture_on = false;
+    spin_unlock_irq(&capture_lock);
+
+    vfree(capture_buf);
+    capture_buf = NULL;
+    atomic_set(&capture_opened, 0);
+
+    return 0;
+}
+
+static ssize_t vhw_capture_read(struct file *pfile, char __user *pbuf, size_t size, loff_t *off)
+{
+    int ret;
+    unsigned int copied;
+
+    if (size < sizeof(struct vhw_capture_rec))
+        return -EINVAL;
+
+    if (kfifo_is_empty(&capture_fifo)) {
+        if (pfile->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+
+        ret = wait_event_interruptible(capture_wq, !kfifo_is_empty(&capture_fifo));
+        if (ret)
+            return ret;
+    }
+
+    /* only whole records are copied */
+    ret = kfifo_to_user(&capture_fifo, pbuf, size, &copied);
+
+    return ret ? ret : copied;
+}
+
+static const struct file_operations vhw_capture_fops = {
+    .owner = THIS_MODULE,
+    .open = vhw_capture_open,
+    .read = vhw_capture_read,
+    .release = vhw_capture_release,
+    .llseek = no_llseek,
+};
+
+/* sleep until the replay catches up with the capture time of "rec" */
+static int vhw_replay_wait(struct vhw_replay *replay, const struct vhw_capture_rec *rec)
+{
+    ktime_t expires;
+
+    if (!replay->started) {
+        replay->started = true;
+        replay->first_ns = rec->ns;
+        replay->start_ns = ktime_get_ns();
+        return 0;
+    }
+
+    if (rec->ns <= replay->first_ns)
+        return 0;
+
+    expires = ns_to_ktime(replay->start_ns + (rec->ns - replay->first_ns));
+
+    while (ktime_before(ktime_get(), expires)) {
+        set_current_state(TASK_INTERRUPTIBLE);
+        schedule_hrtimeout_range(&expires, 0, HRTIMER_MODE_ABS);
+        if (signal_pending(current))
+            return -EINTR;
+    }
+
+    return 0;
+}
+
+static int vhw_replay_rec(struct vhw_replay *replay)
+{
+    int ret;
+    const struct vhw_capture_rec *rec = &replay->rec;
+
+    if (rec->dir != VHW_CAPTURE_RX || rec->type != VHW_REC_IRQ) {
+        capture_stats.skipped++;
+        return 0;
+    }
+
+    if (READ_ONCE(replay_timing)) {
+        ret = vhw_replay_wait(replay, rec);
+        if (ret)
+            return ret;
+    }
+
+    capture_stats.replayed++;
+    vhw_irq_dispatch(rec->id, (int)rec->val, ktime_get_ns());
+
+    return 0;
+}
+
+static int vhw_replay_open(struct inode *pnode, struct file *pfile)
+{
+    struct vhw_replay *replay;
+
+    replay = kzalloc(sizeof(*replay), GFP_KERNEL);
+    if (!replay)
+        return -ENOMEM;
+
+    pfile->private_data = replay;
+
+    return nonseekable_open(pnode, pfile);
+}
+
+static int vhw_replay_release(struct inode *pnode, struct file *pfile)
+{
+    kfree(pfile->private_data);
+
+    return 0;
+}
+
+/*
+ * records may be split across writes, the partial one is kept for the next.
+ * a record interrupted by a signal stays pending, its bytes are already
+ * taken and the next write dispatches it first
+ */
+static ssize_t vhw_replay_write(struct file *pfile, const char __user *pbuf, size_t size, loff_t *off)
+{
+    int ret;
+    size_t n;
+    size_t done = 0;
+    struct vhw_replay *replay = pfile->private_data;
+
+    for (;;) {
+        if (replay->partial == sizeof(replay->rec)) {
+            ret = vhw_replay_rec(replay);
+            if (ret)
+                return done ? done : ret;
+
+            replay->partial = 0;
+        }
+
+        if (done >= size)
+            break;
+
+        n = min(sizeof(replay->rec) - replay->partial, size - done);
+        if (copy_from_user((char *)&replay->rec + replay->partial, pbuf + done, n))
+            return done ? done : -EFAULT;
+
+        done += n;
+        replay->partial += n;
+    }
+
+    return done;
+}
+
+static const struct file_operations vhw_replay_fops = {
+    .owner = THIS_MODULE,
+    .open = vhw_replay_open,
+    .write = vhw_replay_write,
+    .release = vhw_replay_release,
+    .llseek = no_llseek,
+};
+
+static int vhw_capture_stats_show(struct seq_file *m, void *v)
+{
+    seq_printf(m, "capturing: %d\n", READ_ONCE(vhw_capture_on));
+    seq_printf(m, "captured: %llu\n", capture_stats.captured);
+    seq_printf(m, "lost: %llu\n", capture_stats.lost);
+    seq_printf(m, "replayed: %llu\n", capture_stats.replayed);
+    seq_printf(m, "skipped: %llu\n", capture_stats.skipped);
+
+    return 0;
+}
+
+static int vhw_capture_stats_open(struct inode *pnode, struct file *pfile)
+{
+    return single_open(pfile, vhw_capture_stats_show, NULL);
+}
+
+static const struct file_operations vhw_capture_stats_fops = {
+    .owner = THIS_MODULE,
+    .open = vhw_capture_stats_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+void vhw_capture_init(void)
+{
+    /* without debugfs there is no capture */
+    if (!vhw_debugfs_root)
+        return;
+
+    capture_dentry = debugfs_create_file("capture", S_IRUSR, vhw_debugfs_root, NULL,
+                                         &vhw_capture_fops);
+    replay_dentry = debugfs_create_file("replay", S_IWUSR, vhw_debugfs_root, NULL, &vhw_replay_fops);
+    capture_stats_dentry = debugfs_create_file("capture_stats", S_IRUGO, vhw_debugfs_root, NULL,
+                                               &vhw_capture_stats_fops);
+}
+
+/* no replay runs once it returns */
+void vhw_capture_exit(void)
+{
+    debugfs_remove(replay_dentry);
+    debugfs_remove(capture_dentry);
+    debugfs_remove(capture_stats_dentry);
+}
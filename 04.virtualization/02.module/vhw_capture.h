@@ -0,0 +1,33 @@
+#ifndef _VHW_CAPTURE_H_
+#define _VHW_CAPTURE_H_
+
+#include <linux/types.h>
+
+/*
+ * event capture and replay, in the "vhw" debugfs directory
+ *
+ * reading "capture" starts capturing and closing it stops, the file is a
+ * stream of host endian "struct vhw_capture_rec", one per received or sent
+ * record. records which don't fit into the "capture_size" buffer while the
+ * reader is behind are lost and counted in "capture_stats".
+ *
+ * writing such a stream to "replay" feeds the received IRQ records back
+ * into the IRQ dispatch path, the writer sleeps to keep the original gaps
+ * between them unless "replay_timing" is 0.
+ */
+
+#define VHW_CAPTURE_RX          0   /* board -> kernel */
+#define VHW_CAPTURE_TX          1   /* kernel -> board */
+
+struct vhw_capture_rec {
+    __u64                   ns;         /* ktime_get_ns() when received or sent */
+    __u8                    dir;
+    __u8                    reserved1;
+    __u16                   type;       /* VHW_REC_*, 0 for raw data */
+    __u16                   id;
+    __u16                   reserved2;
+    __u32                   val;        /* length of raw data */
+    __u32                   arg;
+};
+
+#endif /* _VHW_CAPTURE_H_ */
@@ -0,0 +1,1306 @@
+#include <linux/kthread.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/errno.h>
+#include <linux/kfifo.h>
+#include <asm/byteorder.h>
+#include <linux/rcupdate.h>
+#include <linux/srcu.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/wait.h>
+#include <linux/uio.h>
+#include <linux/ratelimit.h>
+#include <linux/string.h>
+#include <linux/err.h>
+#include <linux/ktime.h>
+#include <linux/bitops.h>
+#include <linux/log2.h>
+#include <linux/hardirq.h>
+#include <linux/irqflags.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/vmalloc.h>
+#include <linux/jiffies.h>
+#include <linux/hrtimer.h>
+#include <linux/skbuff.h>
+#include <linux/module.h>
+
+#include "vhw.h"
+#include "vhw_priv.h"
+
+#define CREATE_TRACE_POINTS
+#include "vhw_trace.h"
+
+static struct task_struct *event_task;
+static const struct vhw_transport *vhw_transport;
+static bool vhw_online;
+static DEFINE_MUTEX(irq_mutex);
+DEFINE_STATIC_SRCU(irq_srcu);
+/* indexed by IRQ id, written under "irq_mutex" and read under "irq_srcu" */
+static struct vhw_irq __rcu *irq_table[VHW_IRQ_ID_MAX + 1];
+/* runs the VHW_IRQF_DEFERRED callbacks */
+static struct workqueue_struct *irq_wq;
+static struct kmem_cache *irq_cache;
+static DECLARE_WAIT_QUEUE_HEAD(event_wq);
+
+/*
+ * transmit lanes, records (GPIO updates, acknowledges) and the legacy int[3]
+ * records go to the control lane and raw data to the bulk lane, so a burst
+ * of large payloads doesn't hold up the records queued after it. the order
+ * is kept inside a lane only
+ */
+enum {
+    VHW_LANE_CTRL,
+    VHW_LANE_BULK,
+
+    VHW_LANE_MAX
+};
+
+static const char *vhw_lanes[VHW_LANE_MAX] = {
+    [VHW_LANE_CTRL] = "ctrl",
+    [VHW_LANE_BULK] = "bulk",
+};
+
+struct vhw_lane_stats {
+    u64                     batches;
+    u64                     events;
+    u64                     wait_max;   /* longest submit -> send, ns */
+};
+
+static struct vhw_queue tx_queues[VHW_LANE_MAX];
+static struct vhw_lane_stats lane_stats[VHW_LANE_MAX];
+/* control batches sent in a row while the bulk lane is waiting */
+static unsigned int lane_credit;
+/* the event thread and the DMA channels share the transport */
+static DEFINE_MUTEX(tx_mutex);
+
+enum {
+    VHW_POLICY_BLOCK,   /* wait for a free slot, -EAGAIN when the gfp flags of the caller can't sleep */
+    VHW_POLICY_EAGAIN,  /* fail with -EAGAIN */
+    VHW_POLICY_DROP,    /* discard the event, its callback gets -ENOBUFS */
+
+    VHW_POLICY_MAX
+};
+
+static const char *vhw_policies[VHW_POLICY_MAX] = {
+    [VHW_POLICY_BLOCK] = "block",
+    [VHW_POLICY_EAGAIN] = "eagain",
+    [VHW_POLICY_DROP] = "drop",
+};
+
+static int vhw_policy;
+
+/*
+ * "udp" for the multicast board, "ring" for the shared memory board on this
+ * host, "loop" for the in-kernel board model
+ */
+static char *transport = "udp";
+/* maximum number of events packed into one datagram, 1 disables batching */
+static unsigned int batch_max = 1;
+/* time to wait for a batch to fill up before sending it, 0 sends at once */
+static unsigned int batch_flush_us = 0;
+
+/* wire protocol version to send, 0 selects the legacy int[3] format */
+static unsigned int proto_version = VHW_PROTO_VERSION;
+
+/* transmit queue slots, power of 2 */
+static unsigned int queue_size = VHW_FIFO_SIZE;
+/* what a full transmit queue does to the submitter: "block", "eagain" or "drop" */
+static char *queue_policy = "eagain";
+/*
+ * control batches sent for one bulk batch when both lanes are pending,
+ * 0 is strict priority, the bulk lane only goes when the control lane is empty
+ */
+static unsigned int lane_weight = 4;
+
+module_param(transport, charp, S_IRUGO);
+module_param(queue_size, uint, S_IRUGO);
+module_param(queue_policy, charp, S_IRUGO);
+module_param(lane_weight, uint, S_IRUGO | S_IWUSR);
+module_param(batch_max, uint, S_IRUGO);
+module_param(batch_flush_us, uint, S_IRUGO);
+module_param(proto_version, uint, S_IRUGO);
+
+static uint32_t tx_seq;
+
+/*
+ * reliable mode, sent records stay in "rel_events" until the board
+ * acknowledges them and their callbacks are called then
+ */
+static bool reliable;
+/* records in flight at most, power of 2 */
+static unsigned int reliable_window = 256;
+/* time without acknowledge before sending the records again, milliseconds */
+static unsigned int reliable_rto_ms = 20;
+/* timeouts in a row before the records in flight fail */
+static unsigned int reliable_retries = 10;
+
+module_param(reliable, bool, S_IRUGO);
+module_param(reliable_window, uint, S_IRUGO);
+module_param(reliable_rto_ms, uint, S_IRUGO | S_IWUSR);
+module_param(reliable_retries, uint, S_IRUGO | S_IWUSR);
+
+struct vhw_reliable_stats {
+    u64                     acked;
+    u64                     resent;
+    u64                     timeouts;
+};
+
+/* owned by the event thread, except "rel_acked" and "rel_window" written by the receive path */
+static struct vhw_event *rel_events;
+static uint32_t rel_base;           /* oldest record not acknowledged */
+static uint32_t rel_next;           /* sequence of the next record */
+static uint32_t rel_acked;          /* latest cumulative acknowledge */
+static uint32_t rel_window;         /* records the board accepts from "rel_acked" on */
+static unsigned int rel_retries;
+static unsigned long rel_deadline;
+/* the board may expect anything, the first frame restarts it */
+static bool rel_resync = true;
+static struct vhw_reliable_stats rel_stats;
+
+static const struct vhw_transport *vhw_transports[] = {
+    &vhw_udp_transport,
+    &vhw_ring_transport,
+    &vhw_loop_transport
+};
+
+struct vhw_sync {
+    struct completion       done;
+    int                     ret;
+};
+
+static int vhw_event_lane(const struct vhw_event *event)
+{
+    return event->type == VHW_EVENT_RAW ? VHW_LANE_BULK : VHW_LANE_CTRL;
+}
+
+/* only the caller knows its context, "gfp" tells whether the block policy may sleep */
+static int vhw_submit_event(struct vhw_event *event, gfp_t gfp)
+{
+    int ret;
+    struct vhw_queue *queue = &tx_queues[vhw_event_lane(event)];
+
+    if (!vhw_online)
+        return -ENOENT;
+
+    event->submit_ns = ktime_get_ns();
+
+    while (!vhw_queue_push(queue, event)) {
+        switch (vhw_policy) {
+        case VHW_POLICY_BLOCK:
+            if (gfpflags_allow_blocking(gfp)) {
+                ret = wait_event_interruptible(queue->space_wq,
+                                               vhw_queue_has_space(queue) || !vhw_online);
+                if (ret)
+                    return ret;
+                if (!vhw_online)
+                    return -ENOENT;
+                continue;
+            }
+            /* fall through */
+        case VHW_POLICY_EAGAIN:
+            trace_vhw_tx_enqueue(event->type, event->len, -EAGAIN);
+            return -EAGAIN;
+        default:
+            vhw_queue_stat_inc(queue, dropped);
+            trace_vhw_tx_enqueue(event->type, event->len, -ENOBUFS);
+            if (event->buf)
+                vhw_buf_free(event->buf);
+            if (event->done)
+                event->done(-ENOBUFS, event->arg);
+            return 0;
+        }
+    }
+
+    trace_vhw_tx_enqueue(event->type, event->len, 0);
+
+    if (wq_has_sleeper(&event_wq))
+        wake_up(&event_wq);
+
+    return 0;
+}
+
+static int __vhw_submit_data(int type, const void *buffer, int n,
+                             void (*done)(int ret, void *arg), void *arg, gfp_t gfp)
+{
+    int ret;
+    struct vhw_event event;
+
+    if (!buffer || n <= 0 || n > VHW_DATA_MAX)
+        return -EINVAL;
+
+    event.buf = NULL;
+    if (n > VHW_EVENT_DATA_MAX) {
+        event.buf = vhw_buf_alloc();
+        if (!event.buf)
+            return -ENOBUFS;
+        memcpy(event.buf->data, buffer, n);
+    } else {
+        memcpy(event.data, buffer, n);
+    }
+
+    event.type = type;
+    event.len = n;
+    event.done = done;
+    event.arg = arg;
+
+    ret = vhw_submit_event(&event, gfp);
+    if (ret && event.buf)
+        vhw_buf_free(event.buf);
+
+    return ret;
+}
+
+int vhw_submit_data(const void *buffer, int n, void (*done)(int ret, void *arg), void *arg,
+                    gfp_t gfp)
+{
+    return __vhw_submit_data(VHW_EVENT_RAW, buffer, n, done, arg, gfp);
+}
+EXPORT_SYMBOL(vhw_submit_data);
+
+int vhw_submit_rec(int type, int id, uint32_t val, uint32_t rec_arg,
+                   void (*done)(int ret, void *arg), void *arg, gfp_t gfp)
+{
+    struct vhw_event event;
+    struct vhw_frame_rec *rec = (struct vhw_frame_rec *)event.data;
+
+    if (!proto_version) {
+        int legacy_event[3] = {type, id, val};
+
+        return __vhw_submit_data(VHW_EVENT_LEGACY, legacy_event, sizeof(legacy_event), done, arg,
+                                 gfp);
+    }
+
+    rec->type = htons(type);
+    rec->id = htons(id);
+    rec->val = htonl(val);
+    rec->arg = htonl(rec_arg);
+
+    event.type = VHW_EVENT_REC;
+    event.buf = NULL;
+    event.len = sizeof(*rec);
+    event.done = done;
+    event.arg = arg;
+
+    return vhw_submit_event(&event, gfp);
+}
+
+static void vhw_sync_done(int ret, void *arg)
+{
+    struct vhw_sync *sync = arg;
+
+    sync->ret = ret;
+    complete(&sync->done);
+}
+
+int vhw_send_data(const void *buffer, int n)
+{
+    int ret;
+    struct vhw_sync sync;
+
+    init_completion(&sync.done);
+
+    ret = vhw_submit_data(buffer, n, vhw_sync_done, &sync, GFP_KERNEL);
+    if (ret) {
+        printk("in fifo error %d\n", ret);
+        return ret;
+    }
+
+    /* "sync" lives on the stack, so wait until the event thread drops it */
+    wait_for_completion(&sync.done);
+
+    return sync.ret;
+}
+EXPORT_SYMBOL(vhw_send_data);
+
+int vhw_set_gpio_async(int num, bool state, void (*done)(int ret, void *arg), void *arg,
+                       gfp_t gfp)
+{
+    return vhw_submit_rec(VHW_REC_GPIO, num, state, 0, done, arg, gfp);
+}
+EXPORT_SYMBOL(vhw_set_gpio_async);
+
+int vhw_set_gpio(int num, bool state)
+{
+    int ret;
+    struct vhw_sync sync;
+
+    init_completion(&sync.done);
+
+    ret = vhw_set_gpio_async(num, state, vhw_sync_done, &sync, GFP_KERNEL);
+    if (ret) {
+        printk("in fifo error %d\n", ret);
+        return ret;
+    }
+
+    wait_for_completion(&sync.done);
+
+    return sync.ret;
+}
+EXPORT_SYMBOL(vhw_set_gpio);
+
+/* the legacy format has no bank update, send the gpios one by one */
+static int vhw_set_gpio_multiple_legacy(int base, uint32_t mask, uint32_t value,
+                                        void (*done)(int ret, void *arg), void *arg, gfp_t gfp)
+{
+    int ret;
+
+    while (mask) {
+        int bit = __ffs(mask);
+
+        mask &= mask - 1;
+
+        /* only the last gpio reports the completion */
+        ret = vhw_submit_rec(VHW_REC_GPIO, base + bit, !!(value & BIT(bit)), 0,
+                             mask ? NULL : done, arg, gfp);
+        if (ret)
+            return ret;
+    }
+
+    return 0;
+}
+
+int vhw_set_gpio_multiple_async(int base, uint32_t mask, uint32_t value,
+                                void (*done)(int ret, void *arg), void *arg, gfp_t gfp)
+{
+    if (base < 0 || !mask)
+        return -EINVAL;
+
+    if (!proto_version)
+        return vhw_set_gpio_multiple_legacy(base, mask, value, done, arg, gfp);
+
+    return vhw_submit_rec(VHW_REC_GPIO_MULTI, base, mask, value & mask, done, arg, gfp);
+}
+EXPORT_SYMBOL(vhw_set_gpio_multiple_async);
+
+int vhw_set_gpio_multiple(int base, uint32_t mask, uint32_t value)
+{
+    int ret;
+    struct vhw_sync sync;
+
+    init_completion(&sync.done);
+
+    ret = vhw_set_gpio_multiple_async(base, mask, value, vhw_sync_done, &sync, GFP_KERNEL);
+    if (ret) {
+        printk("in fifo error %d\n", ret);
+        return ret;
+    }
+
+    wait_for_completion(&sync.done);
+
+    return sync.ret;
+}
+EXPORT_SYMBOL(vhw_set_gpio_multiple);
+
+static void vhw_irq_work(struct work_struct *work)
+{
+    struct vhw_irq_val irq_val;
+    struct vhw_irq *peripheral = container_of(work, struct vhw_irq, work);
+
+    /* a work item never runs concurrently with itself, so it is the only consumer */
+    while (kfifo_get(&peripheral->fifo, &irq_val)) {
+        vhw_hist_add(VHW_HIST_RX_DISPATCH, ktime_get_ns() - irq_val.rx_ns);
+        peripheral->func(peripheral->id, irq_val.val, peripheral->arg);
+    }
+}
+
+int vhw_register_irq_flags(int id, void (*func)(int id, int val, void *arg), void *arg,
+                           unsigned int flags)
+{
+    struct vhw_irq *peripheral;
+
+    if (id < 0 || id > VHW_IRQ_ID_MAX || !func)
+        return -EINVAL;
+
+    peripheral = kmem_cache_zalloc(irq_cache, GFP_KERNEL);
+    if (!peripheral)
+        return -ENOMEM;
+
+    peripheral->id = id;
+    peripheral->flags = flags;
+    peripheral->func = func;
+    peripheral->arg = arg;
+    INIT_WORK(&peripheral->work, vhw_irq_work);
+    spin_lock_init(&peripheral->lock);
+    INIT_KFIFO(peripheral->fifo);
+
+    mutex_lock(&irq_mutex);
+    if (rcu_access_pointer(irq_table[id])) {
+        mutex_unlock(&irq_mutex);
+        kmem_cache_free(irq_cache, peripheral);
+        return -EBUSY;
+    }
+    rcu_assign_pointer(irq_table[id], peripheral);
+    mutex_unlock(&irq_mutex);
+
+    return 0;
+}
+EXPORT_SYMBOL(vhw_register_irq_flags);
+
+int vhw_register_irq(int id, void (*func)(int id, int val, void *arg), void *arg)
+{
+    return vhw_register_irq_flags(id, func, arg, 0);
+}
+EXPORT_SYMBOL(vhw_register_irq);
+
+void vhw_unregister_irq(int id)
+{
+    struct vhw_irq *peripheral;
+
+    if (id < 0 || id > VHW_IRQ_ID_MAX)
+        return;
+
+    mutex_lock(&irq_mutex);
+    peripheral = rcu_dereference_protected(irq_table[id], lockdep_is_held(&irq_mutex));
+    RCU_INIT_POINTER(irq_table[id], NULL);
+    mutex_unlock(&irq_mutex);
+
+    if (!peripheral)
+        return;
+
+    /* wait for the callbacks which are still running with the old entry */
+    synchronize_srcu(&irq_srcu);
+    cancel_work_sync(&peripheral->work);
+    kmem_cache_free(irq_cache, peripheral);
+}
+EXPORT_SYMBOL(vhw_unregister_irq);
+
+/* "atomic" is set in softirq context, only VHW_IRQF_ATOMIC callbacks run inline then */
+static void __vhw_irq_dispatch(int id, int val, u64 rx_ns, bool atomic)
+{
+    int idx;
+    bool deferred;
+    struct vhw_irq *peripheral;
+
+    if (id < 0 || id > VHW_IRQ_ID_MAX)
+        return;
+
+    vhw_state_irq(id, val, rx_ns);
+
+    idx = srcu_read_lock(&irq_srcu);
+    peripheral = srcu_dereference(irq_table[id], &irq_srcu);
+    deferred = peripheral && ((peripheral->flags & VHW_IRQF_DEFERRED) ||
+                              (atomic && !(peripheral->flags & VHW_IRQF_ATOMIC)));
+    trace_vhw_irq_dispatch(id, val, peripheral, deferred);
+    if (!peripheral) {
+        /* nothing */
+    } else if (deferred) {
+        struct vhw_irq_val irq_val = {
+            .val = val,
+            .rx_ns = rx_ns
+        };
+
+        if (!kfifo_in_spinlocked(&peripheral->fifo, &irq_val, 1, &peripheral->lock)) {
+            peripheral->overflow++;
+            printk_ratelimited("IRQ %d deferred fifo overflow\n", id);
+        }
+        queue_work(irq_wq, &peripheral->work);
+    } else {
+        vhw_hist_add(VHW_HIST_RX_DISPATCH, ktime_get_ns() - rx_ns);
+        peripheral->func(id, val, peripheral->arg);
+    }
+    srcu_read_unlock(&irq_srcu, idx);
+}
+
+void vhw_irq_dispatch(int id, int val, u64 rx_ns)
+{
+    __vhw_irq_dispatch(id, val, rx_ns, false);
+}
+
+static bool vhw_is_frame(const void *buf, int len)
+{
+    const struct vhw_frame_hdr *hdr = buf;
+
+    return len >= sizeof(*hdr) && ntohs(hdr->magic) == VHW_PROTO_MAGIC;
+}
+
+/* called from the receive path */
+static void vhw_reliable_ack(uint32_t seq, uint32_t window)
+{
+    uint32_t old = READ_ONCE(rel_acked);
+
+    if (!reliable)
+        return;
+
+    /* acknowledges may race on several receive queues, only move forward */
+    while ((int32_t)(seq - old) > 0) {
+        uint32_t prev = cmpxchg(&rel_acked, old, seq);
+
+        if (prev == old)
+            break;
+        old = prev;
+    }
+
+    WRITE_ONCE(rel_window, window);
+    wake_up(&event_wq);
+}
+
+static void __vhw_recv_rec(const struct vhw_frame_rec *rec, u64 rx_ns, bool atomic)
+{
+    int type = ntohs(rec->type);
+    int id = ntohs(rec->id);
+    uint32_t val = ntohl(rec->val);
+    uint32_t arg = ntohl(rec->arg);
+
+    vhw_capture(VHW_CAPTURE_RX, type, id, val, arg, rx_ns);
+
+    switch (type) {
+    case VHW_REC_IRQ:
+        __vhw_irq_dispatch(id, (int)val, rx_ns, atomic);
+        break;
+    case VHW_REC_DMA_ACK:
+        vhw_dma_ack(id, val, arg);
+        break;
+    case VHW_REC_ACK:
+        vhw_reliable_ack(val, arg);
+        break;
+    default:
+        printk_ratelimited("record type %d error\n", type);
+        break;
+    }
+}
+
+void vhw_recv_rec(const struct vhw_frame_rec *rec, u64 rx_ns)
+{
+    __vhw_recv_rec(rec, rx_ns, false);
+}
+
+static void vhw_recv_seq(const struct vhw_frame_hdr *hdr, int count, uint32_t *rx_seq)
+{
+    uint32_t seq = ntohl(hdr->seq);
+
+    if (*rx_seq && seq != *rx_seq)
+        printk_ratelimited("frame sequence %u, expect %u\n", seq, *rx_seq);
+    *rx_seq = seq + 1;
+
+    trace_vhw_rx_decode(true, seq, count);
+}
+
+static void vhw_recv_frame(const void *buf, int len, uint32_t *rx_seq, u64 rx_ns)
+{
+    int i;
+    int count;
+    const struct vhw_frame_hdr *hdr = buf;
+    const struct vhw_frame_rec *rec = (const struct vhw_frame_rec *)(hdr + 1);
+
+    if (hdr->version != VHW_PROTO_VERSION) {
+        printk_ratelimited("frame version %d error\n", hdr->version);
+        return;
+    }
+
+    /* fragments have their own sequence */
+    if (hdr->flags & VHW_FRAME_F_DMA) {
+        vhw_dma_recv(hdr + 1, len - sizeof(*hdr));
+        return;
+    }
+
+    count = ntohs(hdr->count);
+    if (len < sizeof(*hdr) + count * sizeof(*rec)) {
+        printk_ratelimited("frame length %d error, count is %d\n", len, count);
+        return;
+    }
+
+    vhw_recv_seq(hdr, count, rx_seq);
+
+    for (i = 0; i < count; i++)
+        vhw_recv_rec(&rec[i], rx_ns);
+}
+
+/* legacy "%04d%04d" text, value in the high digits and IRQ id in the low ones */
+static void vhw_recv_text(char *buf, int len, u64 rx_ns, bool atomic)
+{
+    int ret;
+    int num;
+
+    if (len < 8) {
+        printk_ratelimited("package length error\n");
+        return;
+    }
+
+    buf[len] = '\0';
+
+    ret = sscanf(buf, "%d", &num);
+    if (ret != 1) {
+        printk_ratelimited("package payload error\n");
+        return;
+    }
+
+    trace_vhw_rx_decode(false, 0, 1);
+
+    vhw_capture(VHW_CAPTURE_RX, VHW_REC_IRQ, num % 10000, num / 10000, 0, rx_ns);
+    __vhw_irq_dispatch(num % 10000, num / 10000, rx_ns, atomic);
+}
+
+void vhw_recv_packet(char *buf, int len, uint32_t *rx_seq)
+{
+    u64 rx_ns = ktime_get_ns();
+
+    trace_vhw_rx_packet(len);
+
+    if (vhw_is_frame(buf, len))
+        vhw_recv_frame(buf, len, rx_seq, rx_ns);
+    else
+        vhw_recv_text(buf, len, rx_ns, false);
+}
+
+/* the legacy text is short, it is copied out and parsed */
+static void vhw_recv_skb_text(struct sk_buff *skb, int offset, int len, u64 rx_ns)
+{
+    char text[16];
+
+    len = min_t(int, len, sizeof(text) - 1);
+    if (skb_copy_bits(skb, offset, text, len))
+        return;
+
+    vhw_recv_text(text, len, rx_ns, true);
+}
+
+bool vhw_recv_skb(struct sk_buff *skb, int offset, uint32_t *rx_seq)
+{
+    int i;
+    int count;
+    int len = skb->len - offset;
+    u64 rx_ns = ktime_get_ns();
+    struct vhw_frame_hdr _hdr;
+    struct vhw_frame_rec _rec;
+    const struct vhw_frame_hdr *hdr;
+    const struct vhw_frame_rec *rec;
+
+    hdr = len >= (int)sizeof(_hdr) ? skb_header_pointer(skb, offset, sizeof(_hdr), &_hdr) : NULL;
+    if (!hdr || ntohs(hdr->magic) != VHW_PROTO_MAGIC) {
+        trace_vhw_rx_packet(len);
+        vhw_recv_skb_text(skb, offset, len, rx_ns);
+        return true;
+    }
+
+    /* the header is checked before anything of the frame is looked at */
+    if (hdr->version != VHW_PROTO_VERSION) {
+        trace_vhw_rx_packet(len);
+        printk_ratelimited("frame version %d error\n", hdr->version);
+        return true;
+    }
+
+    if (hdr->flags & VHW_FRAME_F_DMA)
+        return false;
+
+    count = ntohs(hdr->count);
+    if (len < sizeof(*hdr) + count * sizeof(*rec)) {
+        trace_vhw_rx_packet(len);
+        printk_ratelimited("frame length %d error, count is %d\n", len, count);
+        return true;
+    }
+
+    /*
+     * a record which sleeps sends the whole frame to the thread, the socket
+     * callback queues the later frames behind it, so the order is kept
+     */
+    for (i = 0; i < count; i++) {
+        rec = skb_header_pointer(skb, offset + sizeof(*hdr) + i * sizeof(*rec), sizeof(_rec), &_rec);
+        if (ntohs(rec->type) == VHW_REC_DMA_ACK)
+            return false;
+    }
+
+    trace_vhw_rx_packet(len);
+
+    vhw_recv_seq(hdr, count, rx_seq);
+
+    for (i = 0; i < count; i++) {
+        rec = skb_header_pointer(skb, offset + sizeof(*hdr) + i * sizeof(*rec), sizeof(_rec), &_rec);
+        __vhw_recv_rec(rec, rx_ns, true);
+    }
+
+    return true;
+}
+
+int vhw_transport_send(struct kvec *vec, int cnt, size_t len)
+{
+    int ret;
+
+    mutex_lock(&tx_mutex);
+    ret = vhw_transport->send(vec, cnt, len);
+    mutex_unlock(&tx_mutex);
+
+    return ret;
+}
+
+/*
+ * take out as many events of one lane as fit into one datagram, events are
+ * left in the queue when the datagram is full. the receiver can only split
+ * records of a fixed size, so raw data has a datagram of its own
+ */
+static int vhw_event_batch(struct vhw_queue *queue, struct vhw_event *events, struct kvec *vec,
+                           int max, size_t *size)
+{
+    int n;
+    size_t len = 0;
+
+    for (n = 0; n < max; n++) {
+        if (!vhw_queue_peek(queue, &events[n]))
+            break;
+
+        if (n && (events[0].type == VHW_EVENT_RAW || events[n].type != events[0].type ||
+                  len + events[n].len > VHW_BATCH_SIZE_MAX))
+            break;
+
+        vhw_queue_skip(queue);
+
+        vec[n].iov_base = events[n].buf ? events[n].buf->data : events[n].data;
+        vec[n].iov_len = events[n].len;
+        len += events[n].len;
+    }
+
+    *size = len;
+
+    return n;
+}
+
+static void vhw_event_capture(const struct vhw_event *event, u64 ns)
+{
+    const struct vhw_frame_rec *rec = (const struct vhw_frame_rec *)event->data;
+
+    if (event->type == VHW_EVENT_REC)
+        vhw_capture(VHW_CAPTURE_TX, ntohs(rec->type), ntohs(rec->id), ntohl(rec->val),
+                    ntohl(rec->arg), ns);
+    else
+        vhw_capture(VHW_CAPTURE_TX, 0, 0, event->len, 0, ns);
+}
+
+/* mirror the GPIO states the board has been sent */
+static void vhw_event_state(const struct vhw_event *event, u64 ns)
+{
+    const struct vhw_frame_rec *rec = (const struct vhw_frame_rec *)event->data;
+
+    if (event->type != VHW_EVENT_REC)
+        return;
+
+    switch (ntohs(rec->type)) {
+    case VHW_REC_GPIO:
+        vhw_state_gpio(ntohs(rec->id), 1, !!ntohl(rec->val), ns);
+        break;
+    case VHW_REC_GPIO_MULTI:
+        vhw_state_gpio(ntohs(rec->id), ntohl(rec->val), ntohl(rec->arg), ns);
+        break;
+    default:
+        break;
+    }
+}
+
+static void vhw_frame_hdr_init(struct vhw_frame_hdr *hdr, int flags, int count, uint32_t seq)
+{
+    hdr->magic = htons(VHW_PROTO_MAGIC);
+    hdr->version = VHW_PROTO_VERSION;
+    hdr->flags = flags;
+    hdr->count = htons(count);
+    hdr->reserved = 0;
+    hdr->seq = htonl(seq);
+}
+
+/* the acknowledge covers records in flight */
+static bool vhw_reliable_acked(void)
+{
+    uint32_t acked = READ_ONCE(rel_acked);
+
+    return (int32_t)(acked - rel_base) > 0 && (int32_t)(acked - rel_next) <= 0;
+}
+
+/* records which can be sent before the window is full */
+static unsigned int vhw_reliable_room(void)
+{
+    uint32_t window = min(READ_ONCE(rel_window), reliable_window);
+    uint32_t flight = rel_next - rel_base;
+
+    return window > flight ? window - flight : 0;
+}
+
+static int vhw_reliable_flags(uint32_t seq)
+{
+    /* only the oldest record in flight restarts the board */
+    return VHW_FRAME_F_RELIABLE | (rel_resync && seq == rel_base ? VHW_FRAME_F_RESYNC : 0);
+}
+
+static void vhw_reliable_queue(const struct vhw_event *events, int cnt)
+{
+    int i;
+
+    if (rel_next == rel_base)
+        rel_deadline = jiffies + msecs_to_jiffies(reliable_rto_ms);
+
+    for (i = 0; i < cnt; i++)
+        rel_events[rel_next++ & (reliable_window - 1)] = events[i];
+}
+
+static void vhw_reliable_complete(void)
+{
+    u64 now = ktime_get_ns();
+    uint32_t acked = READ_ONCE(rel_acked);
+
+    if ((int32_t)(acked - rel_base) <= 0 || (int32_t)(acked - rel_next) > 0)
+        return;
+
+    while (rel_base != acked) {
+        struct vhw_event *event = &rel_events[rel_base++ & (reliable_window - 1)];
+
+        vhw_hist_add(VHW_HIST_SUBMIT_ACK, now - event->submit_ns);
+        rel_stats.acked++;
+        if (event->done)
+            event->done(0, event->arg);
+    }
+
+    rel_retries = 0;
+    rel_resync = false;
+    rel_deadline = jiffies + msecs_to_jiffies(reliable_rto_ms);
+}
+
+static void vhw_reliable_fail(int ret)
+{
+    while (rel_base != rel_next) {
+        struct vhw_event *event = &rel_events[rel_base++ & (reliable_window - 1)];
+
+        if (event->done)
+            event->done(ret, event->arg);
+    }
+}
+
+/* send all the records in flight again, the board drops what it already has */
+static void vhw_reliable_timeout(struct kvec *vec)
+{
+    uint32_t seq;
+    struct vhw_frame_hdr hdr;
+
+    if (++rel_retries > reliable_retries) {
+        printk_ratelimited("%u reliable records timeout\n", rel_next - rel_base);
+        rel_stats.timeouts++;
+        rel_retries = 0;
+        vhw_reliable_fail(-ETIMEDOUT);
+        /* the board still waits for one of them */
+        rel_resync = true;
+        return;
+    }
+
+    vec[0].iov_base = &hdr;
+    vec[0].iov_len = sizeof(hdr);
+
+    for (seq = rel_base; seq != rel_next; ) {
+        int i;
+        int ret;
+        int cnt = min_t(uint32_t, rel_next - seq, batch_max);
+
+        vhw_frame_hdr_init(&hdr, vhw_reliable_flags(seq), cnt, seq);
+
+        for (i = 0; i < cnt; i++) {
+            struct vhw_event *event = &rel_events[(seq + i) & (reliable_window - 1)];
+
+            vec[i + 1].iov_base = event->data;
+            vec[i + 1].iov_len = event->len;
+        }
+
+        ret = vhw_transport_send(vec, cnt + 1, sizeof(hdr) + cnt * sizeof(struct vhw_frame_rec));
+        trace_vhw_tx_send(cnt, cnt * sizeof(struct vhw_frame_rec), ret);
+
+        rel_stats.resent += cnt;
+        seq += cnt;
+    }
+
+    rel_deadline = jiffies + msecs_to_jiffies(reliable_rto_ms);
+}
+
+/* events which can be taken out of a lane at once, only records are acknowledged */
+static int vhw_event_room(int lane)
+{
+    if (!reliable || lane != VHW_LANE_CTRL)
+        return batch_max;
+
+    return min_t(unsigned int, batch_max, vhw_reliable_room());
+}
+
+static bool vhw_lane_ready(int lane)
+{
+    return !vhw_queue_empty(&tx_queues[lane]) && vhw_event_room(lane);
+}
+
+static bool vhw_event_ready(void)
+{
+    return vhw_lane_ready(VHW_LANE_CTRL) || vhw_lane_ready(VHW_LANE_BULK) ||
+           (reliable && vhw_reliable_acked());
+}
+
+static unsigned int vhw_event_len(void)
+{
+    return vhw_queue_len(&tx_queues[VHW_LANE_CTRL]) + vhw_queue_len(&tx_queues[VHW_LANE_BULK]);
+}
+
+/* the lane of the next batch, weighted round robin between the two lanes */
+static int vhw_lane_next(void)
+{
+    bool ctrl = vhw_lane_ready(VHW_LANE_CTRL);
+    bool bulk = vhw_lane_ready(VHW_LANE_BULK);
+    unsigned int weight = READ_ONCE(lane_weight);
+
+    if (ctrl && (!bulk || !weight || lane_credit < weight)) {
+        if (bulk)
+            lane_credit++;
+        return VHW_LANE_CTRL;
+    }
+
+    if (bulk) {
+        lane_credit = 0;
+        return VHW_LANE_BULK;
+    }
+
+    return -1;
+}
+
+/*
+ * give the producers up to "batch_flush_us" to fill up the batch, a jiffy
+ * is milliseconds, so the wait runs on a high resolution timer
+ */
+static void vhw_event_batch_wait(void)
+{
+    DEFINE_WAIT(wait);
+    ktime_t expires = ktime_add_us(ktime_get(), batch_flush_us);
+
+    for (;;) {
+        prepare_to_wait(&event_wq, &wait, TASK_INTERRUPTIBLE);
+        if (vhw_event_len() >= batch_max || kthread_should_stop())
+            break;
+        /* 0 when the timer expired, woken up early otherwise */
+        if (!schedule_hrtimeout_range(&expires, 0, HRTIMER_MODE_ABS))
+            break;
+    }
+    finish_wait(&event_wq, &wait);
+}
+
+static int vhw_event_task(void *p)
+{
+    static struct vhw_event events[VHW_BATCH_MAX];
+    static struct kvec vec[VHW_BATCH_MAX + 1];
+    struct vhw_frame_hdr hdr;
+
+    while (!kthread_should_stop()) {
+        int i;
+        int ret;
+        int cnt;
+        u64 now;
+        size_t len;
+        int lane;
+        bool acked;
+        long timeout = MAX_SCHEDULE_TIMEOUT;
+
+        /* the retransmission timer */
+        if (reliable && rel_next != rel_base)
+            timeout = max_t(long, (long)(rel_deadline - jiffies), 0);
+
+        ret = wait_event_interruptible_timeout(event_wq, vhw_event_ready() || kthread_should_stop(),
+                                               timeout);
+        if (ret < 0) {
+            printk("wait event error %d\n", ret);
+            break;
+        }
+
+        if (reliable) {
+            vhw_reliable_complete();
+            if (rel_next != rel_base && time_after_eq(jiffies, rel_deadline))
+                vhw_reliable_timeout(vec);
+        }
+
+        if (batch_flush_us && vhw_event_len() < batch_max)
+            vhw_event_batch_wait();
+
+        /* vec[0] is kept for the frame header */
+        while ((lane = vhw_lane_next()) >= 0) {
+            cnt = vhw_event_batch(&tx_queues[lane], events, &vec[1], vhw_event_room(lane), &len);
+            if (!cnt)
+                break;
+
+            /* reliable records complete when they are acknowledged */
+            acked = reliable && events[0].type == VHW_EVENT_REC;
+
+            if (events[0].type == VHW_EVENT_REC) {
+                if (acked)
+                    vhw_frame_hdr_init(&hdr, vhw_reliable_flags(rel_next), cnt, rel_next);
+                else
+                    vhw_frame_hdr_init(&hdr, 0, cnt, tx_seq++);
+
+                vec[0].iov_base = &hdr;
+                vec[0].iov_len = sizeof(hdr);
+
+                ret = vhw_transport_send(vec, cnt + 1, len + sizeof(hdr));
+            } else {
+                ret = vhw_transport_send(&vec[1], cnt, len);
+            }
+
+            trace_vhw_tx_send(cnt, len, ret);
+
+            /* a failed send is recovered by the retransmission */
+            if (acked)
+                vhw_reliable_queue(events, cnt);
+
+            now = ktime_get_ns();
+            lane_stats[lane].batches++;
+            lane_stats[lane].events += cnt;
+            for (i = 0; i < cnt; i++) {
+                u64 wait = now - events[i].submit_ns;
+
+                vhw_event_capture(&events[i], now);
+                if (!ret)
+                    vhw_event_state(&events[i], now);
+                vhw_hist_add(VHW_HIST_SUBMIT_SEND, wait);
+                vhw_hist_add(VHW_HIST_CTRL_SEND + lane, wait);
+                if (wait > lane_stats[lane].wait_max)
+                    lane_stats[lane].wait_max = wait;
+                if (acked)
+                    continue;
+                if (events[i].buf)
+                    vhw_buf_free(events[i].buf);
+                if (events[i].done)
+                    events[i].done(ret, events[i].arg);
+            }
+        }
+    }
+
+    return 0;
+}
+
+static void vhw_event_flush(void)
+{
+    int lane;
+    struct vhw_event event;
+
+    for (lane = 0; lane < VHW_LANE_MAX; lane++) {
+        while (vhw_queue_peek(&tx_queues[lane], &event)) {
+            vhw_queue_skip(&tx_queues[lane]);
+            if (event.buf)
+                vhw_buf_free(event.buf);
+            if (event.done)
+                event.done(-ESHUTDOWN, event.arg);
+        }
+    }
+
+    if (reliable)
+        vhw_reliable_fail(-ESHUTDOWN);
+}
+
+static int vhw_queue_debugfs_show(struct seq_file *m, void *v)
+{
+    int lane;
+
+    seq_printf(m, "policy: %s\n", vhw_policies[vhw_policy]);
+    seq_printf(m, "lane weight: %u%s\n", lane_weight, lane_weight ? "" : " (strict)");
+
+    for (lane = 0; lane < VHW_LANE_MAX; lane++) {
+        struct vhw_lane_stats *stats = &lane_stats[lane];
+
+        vhw_queue_show(m, &tx_queues[lane]);
+        seq_printf(m, "%s: batches %llu events %llu wait max %llu ns\n", vhw_lanes[lane],
+                   stats->batches, stats->events, stats->wait_max);
+    }
+
+    if (reliable)
+        seq_printf(m, "reliable: window %u in flight %u acked %llu resent %llu timeouts %llu\n",
+                   min(READ_ONCE(rel_window), reliable_window), READ_ONCE(rel_next) - READ_ONCE(rel_base),
+                   rel_stats.acked, rel_stats.resent, rel_stats.timeouts);
+
+    return 0;
+}
+
+static int vhw_queue_debugfs_open(struct inode *pnode, struct file *pfile)
+{
+    return single_open(pfile, vhw_queue_debugfs_show, NULL);
+}
+
+static const struct file_operations vhw_queue_fops = {
+    .owner = THIS_MODULE,
+    .open = vhw_queue_debugfs_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+__init static int vhw_init(void)
+{
+    int i;
+    int ret;
+
+    batch_max = clamp_t(unsigned int, batch_max, 1, VHW_BATCH_MAX);
+
+    for (i = 0; i < ARRAY_SIZE(vhw_transports); i++) {
+        if (!strcmp(transport, vhw_transports[i]->name))
+            vhw_transport = vhw_transports[i];
+    }
+    if (!vhw_transport) {
+        printk("transport %s error\n", transport);
+        return -EINVAL;
+    }
+
+    /* the shared memory rings and the board model only handle records */
+    if (vhw_transport != &vhw_udp_transport && !proto_version) {
+        printk("transport %s needs protocol version %d\n", transport, VHW_PROTO_VERSION);
+        proto_version = VHW_PROTO_VERSION;
+    }
+
+    /* the legacy format has no sequence to acknowledge */
+    if (reliable && !proto_version) {
+        printk("reliable mode needs protocol version %d\n", VHW_PROTO_VERSION);
+        reliable = false;
+    }
+
+    /* the rings carry the records without the frame header, the board can't acknowledge them */
+    if (reliable && vhw_transport == &vhw_ring_transport) {
+        printk("reliable mode isn't supported by transport %s\n", transport);
+        reliable = false;
+    }
+
+    for (vhw_policy = 0; vhw_policy < VHW_POLICY_MAX; vhw_policy++) {
+        if (!strcmp(queue_policy, vhw_policies[vhw_policy]))
+            break;
+    }
+    if (vhw_policy == VHW_POLICY_MAX) {
+        printk("queue policy %s error\n", queue_policy);
+        return -EINVAL;
+    }
+
+    queue_size = roundup_pow_of_two(clamp_t(unsigned int, queue_size, 1, VHW_FIFO_SIZE_MAX));
+
+    ret = vhw_debugfs_init();
+    if (ret)
+        return ret;
+
+    irq_cache = KMEM_CACHE(vhw_irq, 0);
+    if (!irq_cache) {
+        ret = -ENOMEM;
+        goto irq_cache_fail;
+    }
+
+    ret = vhw_pool_init();
+    if (ret)
+        goto pool_fail;
+
+    ret = vhw_queue_init(&tx_queues[VHW_LANE_CTRL], vhw_lanes[VHW_LANE_CTRL], queue_size);
+    if (ret)
+        goto queue_fail;
+
+    ret = vhw_queue_init(&tx_queues[VHW_LANE_BULK], vhw_lanes[VHW_LANE_BULK], queue_size);
+    if (ret)
+        goto bulk_queue_fail;
+
+    if (reliable) {
+        reliable_window = roundup_pow_of_two(clamp_t(unsigned int, reliable_window, 1,
+                                                     VHW_RELIABLE_WINDOW_MAX));
+        rel_window = reliable_window;
+        rel_events = vmalloc(reliable_window * sizeof(*rel_events));
+        if (!rel_events) {
+            ret = -ENOMEM;
+            goto reliable_fail;
+        }
+    }
+
+    if (vhw_debugfs_root)
+        debugfs_create_file("queue", S_IRUGO, vhw_debugfs_root, NULL, &vhw_queue_fops);
+
+    /* per-CPU and high priority, a deferred IRQ runs on the CPU which received it */
+    irq_wq = alloc_workqueue("vhw_irq", WQ_HIGHPRI, 0);
+    if (!irq_wq) {
+        ret = -ENOMEM;
+        goto irq_wq_fail;
+    }
+
+    ret = vhw_state_init();
+    if (ret)
+        goto state_fail;
+
+    /* DMA fragments may arrive as soon as the transport is up */
+    ret = vhw_dma_init(proto_version != 0);
+    if (ret)
+        goto dma_fail;
+
+    ret = vhw_transport->init();
+    if (ret)
+        goto transport_fail;
+
+    /* replays and timers dispatch IRQs, everything they use is up */
+    vhw_capture_init();
+    vhw_timer_init();
+
+    event_task = kthread_create(vhw_event_task, NULL, "put_board%d", 1);
+    if (IS_ERR(event_task)) {
+        ret = PTR_ERR(event_task);
+        goto put_thread_fail;
+    }
+
+    vhw_online = true;
+    wake_up_process(event_task);
+
+    printk("VHW initialize OK, transport is %s\n", vhw_transport->name);
+
+    return 0;
+
+put_thread_fail:
+    printk("event thread fail\n");
+    vhw_timer_exit();
+    vhw_capture_exit();
+    vhw_transport->exit();
+transport_fail:
+    printk("transport %s fail\n", vhw_transport->name);
+    vhw_dma_exit();
+dma_fail:
+    printk("DMA fail\n");
+    vhw_state_exit();
+state_fail:
+    printk("state fail\n");
+    destroy_workqueue(irq_wq);
+irq_wq_fail:
+    printk("IRQ workqueue fail\n");
+    vfree(rel_events);
+reliable_fail:
+    printk("reliable window fail\n");
+    vhw_queue_free(&tx_queues[VHW_LANE_BULK]);
+bulk_queue_fail:
+    printk("bulk queue fail\n");
+    vhw_queue_free(&tx_queues[VHW_LANE_CTRL]);
+queue_fail:
+    printk("queue fail\n");
+    vhw_pool_exit();
+pool_fail:
+    printk("pool fail\n");
+    kmem_cache_destroy(irq_cache);
+irq_cache_fail:
+    printk("IRQ cache fail\n");
+    vhw_debugfs_exit();
+    return ret;
+}
+
+__exit static void vhw_deinit(void)
+{
+    vhw_timer_exit();
+    vhw_capture_exit();
+
+    vhw_online = false;
+    wake_up_all(&tx_queues[VHW_LANE_CTRL].space_wq);
+    wake_up_all(&tx_queues[VHW_LANE_BULK].space_wq);
+
+    kthread_stop(event_task);
+    vhw_event_flush();
+
+    /* the DMA workers send through the transport */
+    vhw_dma_exit();
+    vhw_transport->exit();
+    vhw_state_exit();
+
+    destroy_workqueue(irq_wq);
+
+    /* every buffer is back after the flush */
+    vhw_pool_exit();
+    kmem_cache_destroy(irq_cache);
+
+    vhw_debugfs_exit();
+    vfree(rel_events);
+    vhw_queue_free(&tx_queues[VHW_LANE_BULK]);
+    vhw_queue_free(&tx_queues[VHW_LANE_CTRL]);
+
+    printk("VHW deinitialize OK\n");
+}
+
+module_init(vhw_init);
+module_exit(vhw_deinit);
+MODULE_LICENSE("GPL");
@@ -0,0 +1,110 @@
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/percpu.h>
+#include <linux/bitops.h>
+#include <linux/uaccess.h>
+#include <linux/errno.h>
+#include <linux/err.h>
+#include <linux/module.h>
+
+#include "vhw_priv.h"
+
+struct vhw_hist {
+    u64                     bucket[VHW_HIST_BUCKETS];
+};
+
+static const char *vhw_hist_names[VHW_HIST_MAX] = {
+    [VHW_HIST_RX_DISPATCH] = "rx_dispatch_latency",
+    [VHW_HIST_SUBMIT_SEND] = "submit_send_latency",
+    [VHW_HIST_SUBMIT_ACK] = "submit_ack_latency",
+    [VHW_HIST_CTRL_SEND] = "ctrl_send_latency",
+    [VHW_HIST_BULK_SEND] = "bulk_send_latency",
+    [VHW_HIST_TIMER_JITTER] = "timer_jitter",
+};
+
+static DEFINE_PER_CPU(struct vhw_hist [VHW_HIST_MAX], vhw_hists);
+
+struct dentry *vhw_debugfs_root;
+
+void vhw_hist_add(int hist, u64 ns)
+{
+    int bucket = ns ? fls64(ns) - 1 : 0;
+
+    if (bucket >= VHW_HIST_BUCKETS)
+        bucket = VHW_HIST_BUCKETS - 1;
+
+    this_cpu_inc(vhw_hists[hist].bucket[bucket]);
+}
+
+static int vhw_hist_show(struct seq_file *m, void *v)
+{
+    int i;
+    int cpu;
+    long hist = (long)m->private;
+
+    seq_printf(m, "%12s %12s %12s\n", "from(ns)", "to(ns)", "count");
+
+    for (i = 0; i < VHW_HIST_BUCKETS; i++) {
+        u64 count = 0;
+
+        for_each_possible_cpu(cpu)
+            count += per_cpu(vhw_hists, cpu)[hist].bucket[i];
+
+        if (!count)
+            continue;
+
+        seq_printf(m, "%12llu %12llu %12llu\n", i ? 1ULL << i : 0, (1ULL << (i + 1)) - 1, count);
+    }
+
+    return 0;
+}
+
+static int vhw_hist_open(struct inode *pnode, struct file *pfile)
+{
+    return single_open(pfile, vhw_hist_show, pnode->i_private);
+}
+
+/* writing anything clears the histogram */
+static ssize_t vhw_hist_write(struct file *pfile, const char __user *pbuf, size_t size, loff_t *off)
+{
+    int cpu;
+    long hist = (long)((struct seq_file *)pfile->private_data)->private;
+
+    for_each_possible_cpu(cpu)
+        memset(&per_cpu(vhw_hists, cpu)[hist], 0, sizeof(struct vhw_hist));
+
+    return size;
+}
+
+static const struct file_operations vhw_hist_fops = {
+    .owner = THIS_MODULE,
+    .open = vhw_hist_open,
+    .read = seq_read,
+    .write = vhw_hist_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+int vhw_debugfs_init(void)
+{
+    long i;
+
+    vhw_debugfs_root = debugfs_create_dir("vhw", NULL);
+    if (IS_ERR_OR_NULL(vhw_debugfs_root)) {
+        /* debugfs is optional */
+        vhw_debugfs_root = NULL;
+        return 0;
+    }
+
+    for (i = 0; i < VHW_HIST_MAX; i++)
+        debugfs_create_file(vhw_hist_names[i], S_IRUGO | S_IWUSR, vhw_debugfs_root,
+                            (void *)i, &vhw_hist_fops);
+
+    return 0;
+}
+
+void vhw_debugfs_exit(void)
+{
+    debugfs_remove_recursive(vhw_debugfs_root);
+    vhw_debugfs_root = NULL;
+}
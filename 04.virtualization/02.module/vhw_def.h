@@ -2,30 +2,117 @@
 #define _VHW_DEF_H_
 
 #include <linux/types.h>
+#include <linux/gfp.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/kfifo.h>
+#include <linux/list.h>
+#include <linux/llist.h>
+#include <linux/scatterlist.h>
+
+#include "vhw_proto.h"
 
 /* virtual hardware UDP port */
 #define VHW_UDP_PORT            14212
 /* virtual hardware UDP Multicast address */
 #define VHW_GROUP "224.0.2.66"
-/* virtual FIFO size */
+/* maximum number of UDP receive queues, queue N listens on VHW_UDP_PORT + N */
+#define VHW_RX_QUEUE_MAX        16
+/* default virtual FIFO size, power of 2 */
 #define VHW_FIFO_SIZE           128
+/* maximum virtual FIFO size */
+#define VHW_FIFO_SIZE_MAX       65536
+/* virtual event payload carried in the event itself */
+#define VHW_EVENT_DATA_MAX      32
+/* maximum number of events packed into one datagram */
+#define VHW_BATCH_MAX           64
+/* maximum size of a batched datagram, keep it below the ethernet MTU */
+#define VHW_BATCH_SIZE_MAX      1400
+/*
+ * virtual event payload maximum size, larger than VHW_EVENT_DATA_MAX takes a pool buffer,
+ * a raw payload is never batched, so it may fill a whole datagram
+ */
+#define VHW_DATA_MAX            VHW_BATCH_SIZE_MAX
+/* maximum number of records waiting for an acknowledge in reliable mode */
+#define VHW_RELIABLE_WINDOW_MAX 4096
+/* pending values of one deferred IRQ */
+#define VHW_IRQ_FIFO_SIZE       64
+
+/* number of virtual timers */
+#define VHW_TIMER_MAX           8
+/* shortest virtual timer period, nanoseconds */
+#define VHW_TIMER_PERIOD_MIN    1000
+
+/* IRQ registration flags */
+#define VHW_IRQF_DEFERRED       (1 << 0)    /* run the callback from the IRQ workqueue */
+#define VHW_IRQF_ATOMIC         (1 << 1)    /* the callback may run in softirq context */
 
 enum {
-    GPIO_EVENT_ID = 1,  /* virtual hardware maximum IRQ ID  */
+    GPIO_EVENT_ID = VHW_REC_GPIO,  /* virtual hardware maximum IRQ ID  */
 
     VHW_IRQ_ID_MAX = 100 /* virtual hardware maximum IRQ ID */
 };
 
+struct vhw_irq_val {
+    int                     val;
+    u64                     rx_ns;
+};
+
 struct vhw_irq {
-    struct list_head        list;
     int                     id;
+    unsigned int            flags;
     void                    *arg;
     void (*func)(int id, int val, void *arg);
+
+    /* only used by VHW_IRQF_DEFERRED */
+    struct work_struct      work;
+    spinlock_t              lock;
+    unsigned long           overflow;
+    DECLARE_KFIFO(fifo, struct vhw_irq_val, VHW_IRQ_FIFO_SIZE);
+};
+
+enum {
+    VHW_EVENT_RAW = 0,  /* opaque data sent as it is, alone in its datagram */
+    VHW_EVENT_REC,      /* one "struct vhw_frame_rec" packed into a frame */
+    VHW_EVENT_LEGACY,   /* one legacy int[3] record, batched back to back */
+};
+
+/* preallocated payload buffer, owned by the pool of "cpu" */
+struct vhw_buf {
+    struct llist_node       node;
+    int                     cpu;
+    char                    data[VHW_DATA_MAX];
 };
 
 struct vhw_event {
-    const char              *pbuf;
+    uint32_t                type;
+    char                    data[VHW_EVENT_DATA_MAX];
+    /* holds the payload instead of "data" when it is larger */
+    struct vhw_buf          *buf;
     uint32_t                len;
+    u64                     submit_ns;
+    void                    *arg;
+    void (*done)(int ret, void *arg);
+};
+
+/* DMA transfer directions */
+enum {
+    VHW_DMA_TO_BOARD,
+    VHW_DMA_FROM_BOARD,
+};
+
+struct vhw_dma_xfer {
+    int                     dir;
+    struct scatterlist      *sgl;
+    unsigned int            nents;
+    /* bytes to send, or room in the list for the received ones */
+    size_t                  len;
+    void                    *arg;
+    void (*done)(struct vhw_dma_xfer *xfer, int ret, size_t len);
+
+    /* owned by vhw until "done" is called */
+    struct list_head        node;
+    uint32_t                id;
 };
 
 #endif /* _VHW_DEF_H_ */
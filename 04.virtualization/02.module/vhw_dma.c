@@ -0,0 +1,602 @@
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/list.h>
+#include <linux/scatterlist.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/ratelimit.h>
+#include <linux/jiffies.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/moduleparam.h>
+#include <linux/module.h>
+#include <linux/errno.h>
+#include <asm/byteorder.h>
+
+#include "vhw.h"
+#include "vhw_priv.h"
+
+/*
+ * virtual DMA channels
+ *
+ * a transfer is cut into fragments of VHW_DMA_FRAG_DATA_MAX bytes, each one
+ * sent as its own frame with the next fragment sequence of the channel.
+ * the receiver acknowledges the next sequence it expects and how many more
+ * fragments it accepts, the sender keeps no more than that in flight.
+ * fragments are only accepted in order, when nothing is acknowledged for
+ * "dma_rto_ms" the sender goes back to the first unacknowledged one
+ *
+ * one transfer per channel and direction is active at a time, a first
+ * fragment always restarts reception so both sides resynchronize after a
+ * failed transfer
+ */
+
+/* fragments in flight before waiting for an acknowledge */
+static unsigned int dma_window = 32;
+/* time without acknowledge before sending again, milliseconds */
+static unsigned int dma_rto_ms = 20;
+/* timeouts in a row before a transfer fails */
+static unsigned int dma_retries = 10;
+
+module_param(dma_window, uint, S_IRUGO | S_IWUSR);
+module_param(dma_rto_ms, uint, S_IRUGO | S_IWUSR);
+module_param(dma_retries, uint, S_IRUGO | S_IWUSR);
+
+struct vhw_dma_stats {
+    u64                     tx_xfers;
+    u64                     tx_bytes;
+    u64                     tx_frags;
+    u64                     tx_resent;
+    u64                     tx_timeouts;
+    u64                     rx_xfers;
+    u64                     rx_bytes;
+    u64                     rx_frags;
+    u64                     rx_dropped;
+    u64                     rx_errors;
+};
+
+struct vhw_dma_chan {
+    int                     index;
+    struct mutex            lock;
+
+    /* to the board, the first transfer of the list is being sent */
+    struct list_head        tx_list;
+    uint32_t                tx_xfer_id;
+    uint32_t                tx_first;       /* sequence of the first fragment of the transfer */
+    uint32_t                tx_next;        /* next sequence to send */
+    uint32_t                tx_high;        /* next sequence never sent */
+    uint32_t                tx_acked;       /* all sequences before it are acknowledged */
+    uint32_t                tx_window;      /* fragments accepted from "tx_acked" on */
+    unsigned int            tx_retries;
+    struct work_struct      tx_work;
+    struct delayed_work     rto_work;
+    /* only used by "tx_work" */
+    char                    tx_buf[VHW_DMA_FRAG_DATA_MAX];
+
+    /* from the board, the first transfer of the list receives the data */
+    struct list_head        rx_list;
+    bool                    rx_active;
+    bool                    rx_discard;     /* the transfer doesn't fit, ignore its data */
+    uint32_t                rx_xfer_id;
+    uint32_t                rx_expect;
+    size_t                  rx_len;
+
+    struct vhw_dma_stats    stats;
+};
+
+static struct vhw_dma_chan dma_chans[VHW_DMA_CHAN_MAX];
+static struct workqueue_struct *dma_wq;
+static struct dentry *dma_dentry;
+/* written under all the channel locks */
+static bool dma_online;
+static bool dma_enabled;
+
+static uint32_t vhw_dma_frags(size_t len)
+{
+    return DIV_ROUND_UP(len, VHW_DMA_FRAG_DATA_MAX);
+}
+
+static void vhw_dma_tx_work(struct work_struct *work)
+{
+    struct vhw_dma_chan *chan = container_of(work, struct vhw_dma_chan, tx_work);
+    struct vhw_frame_hdr hdr;
+    struct vhw_dma_frag frag;
+    struct kvec vec[3];
+
+    hdr.magic = htons(VHW_PROTO_MAGIC);
+    hdr.version = VHW_PROTO_VERSION;
+    hdr.flags = VHW_FRAME_F_DMA;
+    hdr.count = 0;
+    hdr.reserved = 0;
+    hdr.seq = 0;
+
+    vec[0].iov_base = &hdr;
+    vec[0].iov_len = sizeof(hdr);
+    vec[1].iov_base = &frag;
+    vec[1].iov_len = sizeof(frag);
+    vec[2].iov_base = chan->tx_buf;
+
+    for (;;) {
+        int ret;
+        uint32_t seq;
+        size_t len;
+        size_t offset;
+        struct vhw_dma_xfer *xfer;
+
+        mutex_lock(&chan->lock);
+
+        xfer = list_first_entry_or_null(&chan->tx_list, struct vhw_dma_xfer, node);
+        if (!dma_online || !xfer || chan->tx_next - chan->tx_acked >= chan->tx_window) {
+            mutex_unlock(&chan->lock);
+            break;
+        }
+
+        seq = chan->tx_next;
+        offset = (size_t)(seq - chan->tx_first) * VHW_DMA_FRAG_DATA_MAX;
+        if (offset >= xfer->len) {
+            /* everything is sent, wait for the acknowledge */
+            mutex_unlock(&chan->lock);
+            break;
+        }
+
+        len = min_t(size_t, xfer->len - offset, VHW_DMA_FRAG_DATA_MAX);
+        sg_pcopy_to_buffer(xfer->sgl, xfer->nents, chan->tx_buf, len, offset);
+
+        frag.chan = htons(chan->index);
+        frag.flags = htons((offset ? 0 : VHW_DMA_FRAG_FIRST) |
+                           (offset + len == xfer->len ? VHW_DMA_FRAG_LAST : 0));
+        frag.xfer = htonl(xfer->id);
+        frag.seq = htonl(seq);
+        frag.offset = htonl(offset);
+        frag.total = htonl(xfer->len);
+        frag.len = htons(len);
+        frag.reserved = 0;
+        vec[2].iov_len = len;
+
+        chan->tx_next++;
+        if (seq == chan->tx_high) {
+            chan->tx_high++;
+            chan->stats.tx_frags++;
+            chan->stats.tx_bytes += len;
+        } else {
+            chan->stats.tx_resent++;
+        }
+
+        /* a no-op while it is pending, acknowledges push it back */
+        queue_delayed_work(dma_wq, &chan->rto_work, msecs_to_jiffies(dma_rto_ms));
+
+        mutex_unlock(&chan->lock);
+
+        ret = vhw_transport_send(vec, 3, sizeof(hdr) + sizeof(frag) + len);
+        if (ret) {
+            /* the timeout sends it again */
+            printk_ratelimited("DMA channel %d send error %d\n", chan->index, ret);
+            break;
+        }
+    }
+}
+
+static void vhw_dma_rto_work(struct work_struct *work)
+{
+    struct vhw_dma_chan *chan = container_of(to_delayed_work(work), struct vhw_dma_chan, rto_work);
+    struct vhw_dma_xfer *xfer;
+    struct vhw_dma_xfer *failed = NULL;
+
+    mutex_lock(&chan->lock);
+
+    xfer = list_first_entry_or_null(&chan->tx_list, struct vhw_dma_xfer, node);
+    if (!dma_online || !xfer || (chan->tx_next == chan->tx_acked && chan->tx_window)) {
+        mutex_unlock(&chan->lock);
+        return;
+    }
+
+    if (++chan->tx_retries > dma_retries) {
+        /* the next transfer starts with a first fragment, the board resynchronizes */
+        list_del(&xfer->node);
+        failed = xfer;
+        chan->tx_first = chan->tx_high;
+        chan->tx_next = chan->tx_high;
+        chan->tx_acked = chan->tx_high;
+        chan->tx_retries = 0;
+        chan->stats.tx_timeouts++;
+    } else {
+        /* go back to the first lost fragment, probe a closed window */
+        chan->tx_next = chan->tx_acked;
+        if (!chan->tx_window)
+            chan->tx_window = 1;
+    }
+
+    queue_work(dma_wq, &chan->tx_work);
+
+    mutex_unlock(&chan->lock);
+
+    if (failed) {
+        printk_ratelimited("DMA channel %d transfer %u timeout\n", chan->index, failed->id);
+        failed->done(failed, -ETIMEDOUT, 0);
+    }
+}
+
+void vhw_dma_ack(int index, uint32_t seq, uint32_t window)
+{
+    struct vhw_dma_chan *chan;
+    struct vhw_dma_xfer *xfer;
+    struct vhw_dma_xfer *finished = NULL;
+
+    if (index < 0 || index >= VHW_DMA_CHAN_MAX)
+        return;
+
+    chan = &dma_chans[index];
+
+    mutex_lock(&chan->lock);
+
+    xfer = list_first_entry_or_null(&chan->tx_list, struct vhw_dma_xfer, node);
+    if (!dma_online || !xfer) {
+        mutex_unlock(&chan->lock);
+        return;
+    }
+
+    /* late or bogus acknowledge */
+    if ((int32_t)(seq - chan->tx_acked) < 0 || (int32_t)(seq - chan->tx_high) > 0) {
+        mutex_unlock(&chan->lock);
+        return;
+    }
+
+    chan->tx_window = min(window, dma_window);
+
+    if (seq != chan->tx_acked) {
+        chan->tx_acked = seq;
+        chan->tx_retries = 0;
+        /* fragments before a go back may be acknowledged by the first round */
+        if ((int32_t)(chan->tx_next - seq) < 0)
+            chan->tx_next = seq;
+
+        if (seq - chan->tx_first == vhw_dma_frags(xfer->len)) {
+            list_del(&xfer->node);
+            finished = xfer;
+            chan->tx_first = seq;
+            chan->stats.tx_xfers++;
+        }
+
+        /* progress, restart the timeout */
+        mod_delayed_work(dma_wq, &chan->rto_work, msecs_to_jiffies(dma_rto_ms));
+    }
+
+    /* the timeout also probes a closed window */
+    if (chan->tx_acked == chan->tx_high && (chan->tx_window || list_empty(&chan->tx_list)))
+        cancel_delayed_work(&chan->rto_work);
+    else
+        queue_delayed_work(dma_wq, &chan->rto_work, msecs_to_jiffies(dma_rto_ms));
+
+    queue_work(dma_wq, &chan->tx_work);
+
+    mutex_unlock(&chan->lock);
+
+    if (finished)
+        finished->done(finished, 0, finished->len);
+}
+
+static void vhw_dma_send_ack(struct vhw_dma_chan *chan)
+{
+    uint32_t window = list_empty(&chan->rx_list) ? 0 : dma_window;
+
+    /*
+     * acknowledges are records, the event thread batches them. the receive
+     * thread holds the channel lock, it must not wait for a full queue
+     */
+    vhw_submit_rec(VHW_REC_DMA_ACK, chan->index, chan->rx_expect, window, NULL, NULL, GFP_ATOMIC);
+}
+
+void vhw_dma_recv(const void *buf, int len)
+{
+    int ret = 0;
+    int index;
+    int flags;
+    uint32_t id;
+    uint32_t seq;
+    uint32_t total;
+    size_t offset;
+    size_t frag_len;
+    size_t done_len = 0;
+    struct vhw_dma_chan *chan;
+    struct vhw_dma_xfer *xfer;
+    struct vhw_dma_xfer *finished = NULL;
+    const struct vhw_dma_frag *frag = buf;
+
+    if (len < sizeof(*frag)) {
+        printk_ratelimited("DMA fragment length %d error\n", len);
+        return;
+    }
+
+    index = ntohs(frag->chan);
+    flags = ntohs(frag->flags);
+    id = ntohl(frag->xfer);
+    seq = ntohl(frag->seq);
+    offset = ntohl(frag->offset);
+    total = ntohl(frag->total);
+    frag_len = ntohs(frag->len);
+
+    if (index >= VHW_DMA_CHAN_MAX || frag_len > len - sizeof(*frag) ||
+        frag_len > VHW_DMA_FRAG_DATA_MAX) {
+        printk_ratelimited("DMA fragment channel %d length %zu error\n", index, frag_len);
+        return;
+    }
+
+    chan = &dma_chans[index];
+
+    mutex_lock(&chan->lock);
+
+    if (!dma_online) {
+        mutex_unlock(&chan->lock);
+        return;
+    }
+
+    if (flags & VHW_DMA_FRAG_FIRST) {
+        chan->rx_active = true;
+        chan->rx_discard = false;
+        chan->rx_xfer_id = id;
+        chan->rx_expect = seq;
+        chan->rx_len = 0;
+    }
+
+    xfer = list_first_entry_or_null(&chan->rx_list, struct vhw_dma_xfer, node);
+
+    /* out of order or nowhere to put it, the acknowledge tells what is missing */
+    if (!chan->rx_active || id != chan->rx_xfer_id || seq != chan->rx_expect ||
+        (!xfer && !chan->rx_discard)) {
+        chan->stats.rx_dropped++;
+        goto ack;
+    }
+
+    chan->rx_expect++;
+    chan->stats.rx_frags++;
+
+    if (!chan->rx_discard) {
+        if (offset != chan->rx_len || total > xfer->len || offset + frag_len > xfer->len) {
+            /* keep acknowledging the rest so the board moves on */
+            list_del(&xfer->node);
+            finished = xfer;
+            ret = -EMSGSIZE;
+            chan->rx_discard = true;
+            chan->stats.rx_errors++;
+        } else {
+            sg_pcopy_from_buffer(xfer->sgl, xfer->nents, (void *)(frag + 1), frag_len, offset);
+            chan->rx_len += frag_len;
+            chan->stats.rx_bytes += frag_len;
+        }
+    }
+
+    if (flags & VHW_DMA_FRAG_LAST) {
+        if (!chan->rx_discard) {
+            list_del(&xfer->node);
+            finished = xfer;
+            done_len = chan->rx_len;
+            chan->stats.rx_xfers++;
+        }
+        chan->rx_active = false;
+    }
+
+ack:
+    vhw_dma_send_ack(chan);
+
+    mutex_unlock(&chan->lock);
+
+    if (finished)
+        finished->done(finished, ret, done_len);
+}
+
+int vhw_dma_submit(int index, struct vhw_dma_xfer *xfer)
+{
+    bool opened;
+    struct vhw_dma_chan *chan;
+
+    if (index < 0 || index >= VHW_DMA_CHAN_MAX || !xfer || !xfer->sgl ||
+        !xfer->len || xfer->len > U32_MAX || !xfer->done)
+        return -EINVAL;
+
+    if (xfer->dir != VHW_DMA_TO_BOARD && xfer->dir != VHW_DMA_FROM_BOARD)
+        return -EINVAL;
+
+    if (!dma_enabled)
+        return -EPROTONOSUPPORT;
+
+    chan = &dma_chans[index];
+
+    mutex_lock(&chan->lock);
+
+    if (!dma_online) {
+        mutex_unlock(&chan->lock);
+        return -ENOENT;
+    }
+
+    if (xfer->dir == VHW_DMA_TO_BOARD) {
+        xfer->id = chan->tx_xfer_id++;
+        if (list_empty(&chan->tx_list)) {
+            chan->tx_first = chan->tx_high;
+            chan->tx_next = chan->tx_high;
+            chan->tx_acked = chan->tx_high;
+            chan->tx_window = dma_window;
+            chan->tx_retries = 0;
+        }
+        list_add_tail(&xfer->node, &chan->tx_list);
+        queue_work(dma_wq, &chan->tx_work);
+    } else {
+        opened = list_empty(&chan->rx_list);
+        list_add_tail(&xfer->node, &chan->rx_list);
+        /* the window was closed, tell the board it can go on */
+        if (opened)
+            vhw_dma_send_ack(chan);
+    }
+
+    mutex_unlock(&chan->lock);
+
+    return 0;
+}
+EXPORT_SYMBOL(vhw_dma_submit);
+
+struct vhw_dma_sync {
+    struct completion       done;
+    ssize_t                 ret;
+};
+
+static void vhw_dma_sync_done(struct vhw_dma_xfer *xfer, int ret, size_t len)
+{
+    struct vhw_dma_sync *sync = xfer->arg;
+
+    sync->ret = ret ? ret : len;
+    complete(&sync->done);
+}
+
+ssize_t vhw_dma_transfer(int chan, int dir, struct scatterlist *sgl, unsigned int nents, size_t len)
+{
+    int ret;
+    struct vhw_dma_sync sync;
+    struct vhw_dma_xfer xfer = {
+        .dir = dir,
+        .sgl = sgl,
+        .nents = nents,
+        .len = len,
+        .arg = &sync,
+        .done = vhw_dma_sync_done,
+    };
+
+    init_completion(&sync.done);
+
+    ret = vhw_dma_submit(chan, &xfer);
+    if (ret)
+        return ret;
+
+    /* "xfer" lives on the stack, so wait until vhw drops it */
+    wait_for_completion(&sync.done);
+
+    return sync.ret;
+}
+EXPORT_SYMBOL(vhw_dma_transfer);
+
+/* complete all the transfers of a channel with "ret", called with the lock held */
+static void vhw_dma_abort(struct vhw_dma_chan *chan, struct list_head *list)
+{
+    list_splice_tail_init(&chan->tx_list, list);
+    list_splice_tail_init(&chan->rx_list, list);
+
+    chan->tx_first = chan->tx_high;
+    chan->tx_next = chan->tx_high;
+    chan->tx_acked = chan->tx_high;
+    chan->rx_active = false;
+}
+
+static void vhw_dma_complete(struct list_head *list, int ret)
+{
+    struct vhw_dma_xfer *xfer, *tmp;
+
+    list_for_each_entry_safe(xfer, tmp, list, node) {
+        list_del(&xfer->node);
+        xfer->done(xfer, ret, 0);
+    }
+}
+
+void vhw_dma_terminate(int index)
+{
+    LIST_HEAD(list);
+    struct vhw_dma_chan *chan;
+
+    if (index < 0 || index >= VHW_DMA_CHAN_MAX)
+        return;
+
+    chan = &dma_chans[index];
+
+    mutex_lock(&chan->lock);
+    vhw_dma_abort(chan, &list);
+    mutex_unlock(&chan->lock);
+
+    /* a running worker may still be sending a fragment of them */
+    cancel_delayed_work_sync(&chan->rto_work);
+    flush_work(&chan->tx_work);
+
+    vhw_dma_complete(&list, -ECANCELED);
+}
+EXPORT_SYMBOL(vhw_dma_terminate);
+
+static int vhw_dma_show(struct seq_file *m, void *v)
+{
+    int i;
+
+    seq_printf(m, "%4s %10s %12s %10s %10s %10s %10s %12s %10s %10s %10s\n",
+               "chan", "tx_xfers", "tx_bytes", "tx_frags", "resent", "timeouts",
+               "rx_xfers", "rx_bytes", "rx_frags", "dropped", "errors");
+
+    for (i = 0; i < VHW_DMA_CHAN_MAX; i++) {
+        struct vhw_dma_stats *stats = &dma_chans[i].stats;
+
+        seq_printf(m, "%4d %10llu %12llu %10llu %10llu %10llu %10llu %12llu %10llu %10llu %10llu\n",
+                   i, stats->tx_xfers, stats->tx_bytes, stats->tx_frags, stats->tx_resent,
+                   stats->tx_timeouts, stats->rx_xfers, stats->rx_bytes, stats->rx_frags,
+                   stats->rx_dropped, stats->rx_errors);
+    }
+
+    return 0;
+}
+
+static int vhw_dma_open(struct inode *pnode, struct file *pfile)
+{
+    return single_open(pfile, vhw_dma_show, NULL);
+}
+
+static const struct file_operations vhw_dma_fops = {
+    .owner = THIS_MODULE,
+    .open = vhw_dma_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+int vhw_dma_init(bool enable)
+{
+    int i;
+
+    for (i = 0; i < VHW_DMA_CHAN_MAX; i++) {
+        struct vhw_dma_chan *chan = &dma_chans[i];
+
+        chan->index = i;
+        mutex_init(&chan->lock);
+        INIT_LIST_HEAD(&chan->tx_list);
+        INIT_LIST_HEAD(&chan->rx_list);
+        INIT_WORK(&chan->tx_work, vhw_dma_tx_work);
+        INIT_DELAYED_WORK(&chan->rto_work, vhw_dma_rto_work);
+    }
+
+    dma_wq = alloc_workqueue("vhw_dma", WQ_UNBOUND, 0);
+    if (!dma_wq) {
+        printk("DMA workqueue fail\n");
+        return -ENOMEM;
+    }
+
+    if (vhw_debugfs_root)
+        dma_dentry = debugfs_create_file("dma", S_IRUGO, vhw_debugfs_root, NULL, &vhw_dma_fops);
+
+    dma_enabled = enable;
+    dma_online = true;
+
+    return 0;
+}
+
+void vhw_dma_exit(void)
+{
+    int i;
+    LIST_HEAD(list);
+
+    /* the receive path may still call in, it only queues work while online */
+    for (i = 0; i < VHW_DMA_CHAN_MAX; i++) {
+        mutex_lock(&dma_chans[i].lock);
+        dma_online = false;
+        vhw_dma_abort(&dma_chans[i], &list);
+        mutex_unlock(&dma_chans[i].lock);
+    }
+
+    for (i = 0; i < VHW_DMA_CHAN_MAX; i++)
+        cancel_delayed_work_sync(&dma_chans[i].rto_work);
+    destroy_workqueue(dma_wq);
+
+    vhw_dma_complete(&list, -ESHUTDOWN);
+
+    debugfs_remove(dma_dentry);
+}
@@ -0,0 +1,375 @@
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/kfifo.h>
+#include <linux/random.h>
+#include <linux/bitops.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/moduleparam.h>
+#include <linux/module.h>
+#include <linux/errno.h>
+#include <linux/err.h>
+#include <asm/byteorder.h>
+
+#include "vhw_priv.h"
+
+/*
+ * in-kernel board model, loaded with "transport=loop"
+ *
+ * sent GPIO records update the model, received IRQ records are generated
+ * by a thread at "loop_rate" events per second and go through the same
+ * frame decoding and IRQ dispatching as UDP datagrams
+ *
+ * DMA fragments sent to the model are consumed in order and acknowledged
+ * with an open window, the data is thrown away, reliable records are
+ * acknowledged the same way
+ */
+
+/* records of one generated frame */
+#define VHW_LOOP_BATCH_MAX      64
+/* GPIO numbers tracked by the model */
+#define VHW_LOOP_GPIO_MAX       256
+/* maximum number of IRQ ids to generate */
+#define VHW_LOOP_IDS_MAX        32
+/* frames injected in a row before the thread goes to the timed sleep */
+#define VHW_LOOP_PASS_MAX       16
+
+/* generated IRQ events per second, 0 only echoes GPIO writes */
+static unsigned int loop_rate;
+/* generated IRQ events per frame */
+static unsigned int loop_batch = 1;
+/* IRQ ids to generate, picked at random, default are the board keys */
+static int loop_ids[VHW_LOOP_IDS_MAX] = {5, 6, 7, 8};
+static int loop_ids_num = 4;
+/* generated values are random in [0, loop_val_max], 1 presses a key */
+static unsigned int loop_val_max = 1;
+/* raise IRQ "loop_echo_base + gpio" with the state for every GPIO write */
+static bool loop_echo;
+static int loop_echo_base = 5;
+
+module_param(loop_rate, uint, S_IRUGO | S_IWUSR);
+module_param(loop_batch, uint, S_IRUGO | S_IWUSR);
+module_param_array(loop_ids, int, &loop_ids_num, S_IRUGO);
+module_param(loop_val_max, uint, S_IRUGO | S_IWUSR);
+module_param(loop_echo, bool, S_IRUGO | S_IWUSR);
+module_param(loop_echo_base, int, S_IRUGO | S_IWUSR);
+
+struct vhw_loop_stats {
+    u64                     tx_frames;
+    u64                     tx_records;
+    u64                     tx_raw;
+    u64                     rx_frames;
+    u64                     rx_generated;
+    u64                     rx_echoed;
+    u64                     echo_drops;
+    u64                     dma_frags;
+    u64                     dma_bytes;
+};
+
+static struct task_struct *loop_task;
+static struct dentry *loop_dentry;
+static struct vhw_loop_stats loop_stats;
+static DECLARE_BITMAP(loop_gpio, VHW_LOOP_GPIO_MAX);
+/* the event thread produces, the loop thread consumes */
+static DEFINE_KFIFO(echo_fifo, struct vhw_frame_rec, 256);
+static uint32_t loop_seq;
+/* next DMA fragment sequence expected on each channel */
+static uint32_t loop_dma_expect[VHW_DMA_CHAN_MAX];
+/* next reliable record sequence expected */
+static uint32_t loop_rel_expect;
+static char loop_buf[VHW_FRAME_SIZE_MAX + 1];
+
+static void vhw_loop_rec(struct vhw_frame_rec *rec, int id, int val)
+{
+    rec->type = htons(VHW_REC_IRQ);
+    rec->id = htons(id);
+    rec->val = htonl(val);
+    rec->arg = 0;
+}
+
+static void vhw_loop_generate(struct vhw_frame_rec *rec)
+{
+    int id = loop_ids[prandom_u32_max(loop_ids_num)];
+    int val = loop_val_max ? prandom_u32_max(loop_val_max + 1) : 0;
+
+    vhw_loop_rec(rec, id, val);
+}
+
+/* hand "count" records to the receive path as one frame */
+static void vhw_loop_inject(int count)
+{
+    uint32_t rx_seq = loop_seq;
+    struct vhw_frame_hdr *hdr = (struct vhw_frame_hdr *)loop_buf;
+
+    hdr->magic = htons(VHW_PROTO_MAGIC);
+    hdr->version = VHW_PROTO_VERSION;
+    hdr->flags = 0;
+    hdr->count = htons(count);
+    hdr->reserved = 0;
+    hdr->seq = htonl(loop_seq++);
+
+    loop_stats.rx_frames++;
+
+    vhw_recv_packet(loop_buf, sizeof(*hdr) + count * sizeof(struct vhw_frame_rec), &rx_seq);
+}
+
+static int vhw_loop_entry(void *p)
+{
+    u64 next_ns = ktime_get_ns();
+    unsigned int passes = 0;
+    struct vhw_frame_rec *recs = (struct vhw_frame_rec *)(loop_buf + sizeof(struct vhw_frame_hdr));
+
+    while (!kthread_should_stop()) {
+        int n;
+        int count = 0;
+        u64 now;
+        unsigned int rate = READ_ONCE(loop_rate);
+        unsigned int batch = clamp_t(unsigned int, READ_ONCE(loop_batch), 1, VHW_LOOP_BATCH_MAX);
+
+        /* echoed GPIO writes go first, they are the round trips being measured */
+        while (count < VHW_LOOP_BATCH_MAX && kfifo_get(&echo_fifo, &recs[count]))
+            count++;
+        loop_stats.rx_echoed += count;
+
+        now = ktime_get_ns();
+        if (rate && loop_ids_num && now >= next_ns) {
+            n = min_t(int, batch, VHW_LOOP_BATCH_MAX - count);
+
+            while (n--) {
+                vhw_loop_generate(&recs[count++]);
+                loop_stats.rx_generated++;
+            }
+
+            next_ns += div_u64((u64)NSEC_PER_SEC * batch, rate);
+            /* don't burst to catch up after a long stall */
+            if (now > next_ns + NSEC_PER_SEC)
+                next_ns = now;
+        }
+
+        if (count) {
+            vhw_loop_inject(count);
+            if (++passes < VHW_LOOP_PASS_MAX)
+                continue;
+        }
+
+        /* a rate above what the thread can inject must not hog the CPU */
+        passes = 0;
+        cond_resched();
+
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (!kfifo_is_empty(&echo_fifo) || kthread_should_stop()) {
+            __set_current_state(TASK_RUNNING);
+            continue;
+        }
+
+        if (rate) {
+            ktime_t expires = ns_to_ktime(next_ns);
+
+            schedule_hrtimeout_range(&expires, 0, HRTIMER_MODE_ABS);
+        } else {
+            /* woken up by echoed GPIO writes or a new "loop_rate" */
+            schedule_timeout(HZ);
+        }
+    }
+
+    return 0;
+}
+
+/* apply one GPIO write to the model, it returns true if it is echoed */
+static bool vhw_loop_gpio(int id, bool state)
+{
+    struct vhw_frame_rec echo;
+
+    if (id >= VHW_LOOP_GPIO_MAX)
+        return false;
+
+    if (state)
+        set_bit(id, loop_gpio);
+    else
+        clear_bit(id, loop_gpio);
+
+    if (!READ_ONCE(loop_echo))
+        return false;
+
+    vhw_loop_rec(&echo, loop_echo_base + id, state);
+    if (!kfifo_put(&echo_fifo, echo)) {
+        loop_stats.echo_drops++;
+        return false;
+    }
+
+    return true;
+}
+
+/* a board with a DMA sink on every channel, it returns true if it is acknowledged */
+static bool vhw_loop_dma(const struct vhw_dma_frag *frag)
+{
+    int chan = ntohs(frag->chan);
+    uint32_t seq = ntohl(frag->seq);
+    struct vhw_frame_rec ack;
+
+    if (chan >= VHW_DMA_CHAN_MAX)
+        return false;
+
+    if (seq == loop_dma_expect[chan] || (ntohs(frag->flags) & VHW_DMA_FRAG_FIRST)) {
+        loop_dma_expect[chan] = seq + 1;
+        loop_stats.dma_frags++;
+        loop_stats.dma_bytes += ntohs(frag->len);
+    }
+
+    ack.type = htons(VHW_REC_DMA_ACK);
+    ack.id = htons(chan);
+    ack.val = htonl(loop_dma_expect[chan]);
+    ack.arg = htonl(VHW_LOOP_BATCH_MAX);
+    if (!kfifo_put(&echo_fifo, ack)) {
+        loop_stats.echo_drops++;
+        return false;
+    }
+
+    return true;
+}
+
+/* skip the records of a reliable frame which were received already */
+static int vhw_loop_reliable(const struct vhw_frame_hdr *hdr, int count, bool *echoed)
+{
+    uint32_t seq = ntohl(hdr->seq);
+    uint32_t first = loop_rel_expect - seq;
+    struct vhw_frame_rec ack;
+
+    if (hdr->flags & VHW_FRAME_F_RESYNC)
+        first = 0;
+
+    /* a gap, drop the frame and tell what is missing */
+    if (first > count)
+        first = count;
+    else
+        loop_rel_expect = seq + count;
+
+    ack.type = htons(VHW_REC_ACK);
+    ack.id = 0;
+    ack.val = htonl(loop_rel_expect);
+    ack.arg = htonl(VHW_RELIABLE_WINDOW_MAX);
+    if (kfifo_put(&echo_fifo, ack))
+        *echoed = true;
+    else
+        loop_stats.echo_drops++;
+
+    return first;
+}
+
+static int vhw_loop_send(struct kvec *vec, int cnt, size_t len)
+{
+    int i;
+    int first = 0;
+    bool echoed = false;
+    const struct vhw_frame_hdr *hdr = vec[0].iov_base;
+
+    if (vec[0].iov_len != sizeof(*hdr) || ntohs(hdr->magic) != VHW_PROTO_MAGIC) {
+        loop_stats.tx_raw++;
+        return 0;
+    }
+
+    loop_stats.tx_frames++;
+
+    if (hdr->flags & VHW_FRAME_F_DMA) {
+        if (cnt > 1 && vec[1].iov_len == sizeof(struct vhw_dma_frag) && vhw_loop_dma(vec[1].iov_base))
+            wake_up_process(loop_task);
+        return 0;
+    }
+
+    if (hdr->flags & VHW_FRAME_F_RELIABLE)
+        first = vhw_loop_reliable(hdr, cnt - 1, &echoed);
+
+    for (i = 1 + first; i < cnt; i++) {
+        const struct vhw_frame_rec *rec = vec[i].iov_base;
+        int id = ntohs(rec->id);
+        uint32_t val = ntohl(rec->val);
+
+        loop_stats.tx_records++;
+
+        switch (ntohs(rec->type)) {
+        case VHW_REC_GPIO:
+            echoed |= vhw_loop_gpio(id, val);
+            break;
+        case VHW_REC_GPIO_MULTI: {
+            uint32_t value = ntohl(rec->arg);
+
+            while (val) {
+                int bit = __ffs(val);
+
+                val &= val - 1;
+                echoed |= vhw_loop_gpio(id + bit, value & BIT(bit));
+            }
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    /* the loop thread injects the echo, handlers may send from the receive path */
+    if (echoed)
+        wake_up_process(loop_task);
+
+    return 0;
+}
+
+static int vhw_loop_show(struct seq_file *m, void *v)
+{
+    seq_printf(m, "tx_frames: %llu\n", loop_stats.tx_frames);
+    seq_printf(m, "tx_records: %llu\n", loop_stats.tx_records);
+    seq_printf(m, "tx_raw: %llu\n", loop_stats.tx_raw);
+    seq_printf(m, "rx_frames: %llu\n", loop_stats.rx_frames);
+    seq_printf(m, "rx_generated: %llu\n", loop_stats.rx_generated);
+    seq_printf(m, "rx_echoed: %llu\n", loop_stats.rx_echoed);
+    seq_printf(m, "echo_drops: %llu\n", loop_stats.echo_drops);
+    seq_printf(m, "dma_frags: %llu\n", loop_stats.dma_frags);
+    seq_printf(m, "dma_bytes: %llu\n", loop_stats.dma_bytes);
+    seq_printf(m, "gpio: %*pb\n", VHW_LOOP_GPIO_MAX, loop_gpio);
+
+    return 0;
+}
+
+static int vhw_loop_open(struct inode *pnode, struct file *pfile)
+{
+    return single_open(pfile, vhw_loop_show, NULL);
+}
+
+static const struct file_operations vhw_loop_fops = {
+    .owner = THIS_MODULE,
+    .open = vhw_loop_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static int vhw_loop_init(void)
+{
+    if (loop_ids_num <= 0)
+        printk("loop has no IRQ id to generate\n");
+
+    loop_task = kthread_run(vhw_loop_entry, NULL, "vhw_loop");
+    if (IS_ERR(loop_task)) {
+        printk("loop thread fail\n");
+        return PTR_ERR(loop_task);
+    }
+
+    if (vhw_debugfs_root)
+        loop_dentry = debugfs_create_file("loop", S_IRUGO, vhw_debugfs_root, NULL, &vhw_loop_fops);
+
+    return 0;
+}
+
+static void vhw_loop_exit(void)
+{
+    debugfs_remove(loop_dentry);
+    kthread_stop(loop_task);
+}
+
+const struct vhw_transport vhw_loop_transport = {
+    .name = "loop",
+    .init = vhw_loop_init,
+    .exit = vhw_loop_exit,
+    .send = vhw_loop_send,
+};
@@ -0,0 +1,161 @@
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/llist.h>
+#include <linux/atomic.h>
+#include <linux/irqflags.h>
+#include <linux/topology.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/moduleparam.h>
+#include <linux/module.h>
+#include <linux/errno.h>
+
+#include "vhw_priv.h"
+
+/*
+ * preallocated payload buffers
+ *
+ * every CPU owns "pool_size" buffers, it takes them from its own free list
+ * with interrupts disabled, so it is the only consumer of the list, and any
+ * CPU gives them back to the list of the owner without a lock. an empty
+ * pool fails the allocation instead of falling back to the slab allocator,
+ * the memory used for payloads never grows
+ */
+
+/* payload buffers of each CPU */
+static unsigned int pool_size = 64;
+
+module_param(pool_size, uint, S_IRUGO);
+
+struct vhw_pool {
+    struct llist_head       free;
+    unsigned int            size;
+    atomic_t                used;
+    unsigned long           empty;      /* allocations which found no buffer */
+};
+
+static DEFINE_PER_CPU(struct vhw_pool, vhw_pools);
+static struct kmem_cache *buf_cache;
+static struct dentry *pool_dentry;
+
+struct vhw_buf *vhw_buf_alloc(void)
+{
+    unsigned long flags;
+    struct vhw_pool *pool;
+    struct llist_node *node;
+
+    local_irq_save(flags);
+
+    pool = this_cpu_ptr(&vhw_pools);
+    node = llist_del_first(&pool->free);
+    if (node)
+        atomic_inc(&pool->used);
+    else
+        pool->empty++;
+
+    local_irq_restore(flags);
+
+    return node ? llist_entry(node, struct vhw_buf, node) : NULL;
+}
+
+void vhw_buf_free(struct vhw_buf *buf)
+{
+    struct vhw_pool *pool = per_cpu_ptr(&vhw_pools, buf->cpu);
+
+    atomic_dec(&pool->used);
+    llist_add(&buf->node, &pool->free);
+}
+
+static int vhw_pool_show(struct seq_file *m, void *v)
+{
+    int cpu;
+
+    seq_printf(m, "%4s %8s %8s %12s\n", "cpu", "size", "used", "empty");
+
+    for_each_possible_cpu(cpu) {
+        struct vhw_pool *pool = per_cpu_ptr(&vhw_pools, cpu);
+
+        seq_printf(m, "%4d %8u %8d %12lu\n", cpu, pool->size, atomic_read(&pool->used), pool->empty);
+    }
+
+    return 0;
+}
+
+static int vhw_pool_open(struct inode *pnode, struct file *pfile)
+{
+    return single_open(pfile, vhw_pool_show, NULL);
+}
+
+static const struct file_operations vhw_pool_fops = {
+    .owner = THIS_MODULE,
+    .open = vhw_pool_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static void vhw_pool_free(void)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct vhw_pool *pool = per_cpu_ptr(&vhw_pools, cpu);
+        struct llist_node *node = llist_del_all(&pool->free);
+
+        while (node) {
+            struct vhw_buf *buf = llist_entry(node, struct vhw_buf, node);
+
+            node = node->next;
+            kmem_cache_free(buf_cache, buf);
+        }
+
+        pool->size = 0;
+    }
+}
+
+int vhw_pool_init(void)
+{
+    int i;
+    int cpu;
+
+    buf_cache = kmem_cache_create("vhw_buf", sizeof(struct vhw_buf), 0, SLAB_HWCACHE_ALIGN, NULL);
+    if (!buf_cache) {
+        printk("buffer cache fail\n");
+        return -ENOMEM;
+    }
+
+    for_each_possible_cpu(cpu) {
+        struct vhw_pool *pool = per_cpu_ptr(&vhw_pools, cpu);
+
+        init_llist_head(&pool->free);
+        atomic_set(&pool->used, 0);
+        pool->empty = 0;
+
+        for (i = 0; i < pool_size; i++) {
+            struct vhw_buf *buf = kmem_cache_alloc_node(buf_cache, GFP_KERNEL, cpu_to_node(cpu));
+
+            if (!buf) {
+                printk("CPU %d buffer pool fail\n", cpu);
+                vhw_pool_free();
+                kmem_cache_destroy(buf_cache);
+                return -ENOMEM;
+            }
+
+            buf->cpu = cpu;
+            llist_add(&buf->node, &pool->free);
+            pool->size++;
+        }
+    }
+
+    if (vhw_debugfs_root)
+        pool_dentry = debugfs_create_file("pool", S_IRUGO, vhw_debugfs_root, NULL, &vhw_pool_fops);
+
+    return 0;
+}
+
+void vhw_pool_exit(void)
+{
+    debugfs_remove(pool_dentry);
+    vhw_pool_free();
+    kmem_cache_destroy(buf_cache);
+}
@@ -0,0 +1,245 @@
+#ifndef _VHW_PRIV_H_
+#define _VHW_PRIV_H_
+
+#include <linux/uio.h>
+#include <linux/debugfs.h>
+#include <linux/atomic.h>
+#include <linux/wait.h>
+#include <linux/cache.h>
+#include <linux/seq_file.h>
+#include <linux/skbuff.h>
+
+#include "vhw_def.h"
+#include "vhw_capture.h"
+
+/*
+ * virtual hardware transport, it moves datagrams between the event thread
+ * and the board and feeds the received ones into vhw_recv_packet() or
+ * vhw_recv_rec()
+ */
+struct vhw_transport {
+    const char              *name;
+
+    int (*init)(void);
+    void (*exit)(void);
+    /*
+     * calls are serialized by vhw_transport_send(), vec[0] is the frame
+     * header for records and DMA fragments
+     */
+    int (*send)(struct kvec *vec, int cnt, size_t len);
+};
+
+extern const struct vhw_transport vhw_udp_transport;
+extern const struct vhw_transport vhw_ring_transport;
+extern const struct vhw_transport vhw_loop_transport;
+
+struct vhw_queue_stats {
+    u64                     enqueued;
+    u64                     dropped;    /* discarded by the "drop" policy */
+    u64                     full;       /* pushes which found the queue full */
+};
+
+struct vhw_queue_slot {
+    atomic_t                seq;
+    struct vhw_event        event;
+};
+
+/* lock-free bounded multi-producer single-consumer event queue */
+struct vhw_queue {
+    const char              *name;
+    unsigned int            size;
+    struct vhw_queue_slot   *slots;
+    struct vhw_queue_stats __percpu *stats;
+    /* producers waiting for a free slot */
+    wait_queue_head_t       space_wq;
+
+    atomic_t                tail ____cacheline_aligned_in_smp;
+    unsigned int            head ____cacheline_aligned_in_smp;
+};
+
+/*
+ * @bref initialize a queue
+ *
+ * @param size number of slots, power of 2
+ */
+int vhw_queue_init(struct vhw_queue *queue, const char *name, unsigned int size);
+void vhw_queue_free(struct vhw_queue *queue);
+
+/*
+ * @bref put an event into the queue, safe against other producers
+ *
+ * @return false if the queue is full
+ */
+bool vhw_queue_push(struct vhw_queue *queue, const struct vhw_event *event);
+
+/* consumer side, only one thread may call these */
+bool vhw_queue_peek(struct vhw_queue *queue, struct vhw_event *event);
+void vhw_queue_skip(struct vhw_queue *queue);
+bool vhw_queue_empty(struct vhw_queue *queue);
+
+unsigned int vhw_queue_len(struct vhw_queue *queue);
+bool vhw_queue_has_space(struct vhw_queue *queue);
+void vhw_queue_show(struct seq_file *m, struct vhw_queue *queue);
+
+#define vhw_queue_stat_inc(queue, field) this_cpu_inc((queue)->stats->field)
+
+/*
+ * @bref set up the per-CPU payload buffer pools
+ */
+int vhw_pool_init(void);
+void vhw_pool_exit(void);
+
+/*
+ * @bref take a payload buffer from the pool of this CPU, it never sleeps
+ *
+ * @return NULL when the pool is empty
+ */
+struct vhw_buf *vhw_buf_alloc(void);
+
+/*
+ * @bref give a payload buffer back to its pool, from any CPU
+ */
+void vhw_buf_free(struct vhw_buf *buf);
+
+/*
+ * @bref hand one datagram to the transport, safe to call from any thread
+ *       which may sleep
+ */
+int vhw_transport_send(struct kvec *vec, int cnt, size_t len);
+
+/*
+ * @bref queue one record for the board, see vhw_set_gpio_async()
+ */
+int vhw_submit_rec(int type, int id, uint32_t val, uint32_t rec_arg,
+                   void (*done)(int ret, void *arg), void *arg, gfp_t gfp);
+
+/*
+ * @bref set up the board state mirror, misc device "vhw_state"
+ */
+int vhw_state_init(void);
+void vhw_state_exit(void);
+
+/*
+ * @bref mirror GPIO states sent to the board
+ *
+ * @param base first gpio number
+ * @param mask bit N selects gpio "base + N"
+ * @param value bit N is the state of gpio "base + N"
+ * @param ns ktime_get_ns() when sent
+ */
+void vhw_state_gpio(int base, uint32_t mask, uint32_t value, u64 ns);
+
+/*
+ * @bref mirror an IRQ value received from the board
+ */
+void vhw_state_irq(int id, int val, u64 ns);
+
+/*
+ * @bref set up the DMA channels, they are started before the transport
+ *       and stopped before it
+ *
+ * @param enable false if the wire format can't carry DMA fragments
+ */
+int vhw_dma_init(bool enable);
+void vhw_dma_exit(void);
+
+/*
+ * @bref handle one received DMA fragment
+ *
+ * @param buf fragment header and data, after the frame header
+ * @param len size of "buf"
+ */
+void vhw_dma_recv(const void *buf, int len);
+
+/*
+ * @bref handle an acknowledge of the fragments sent on a DMA channel
+ */
+void vhw_dma_ack(int chan, uint32_t seq, uint32_t window);
+
+/* virtual timers, stopped before the IRQ workqueue goes away */
+void vhw_timer_init(void);
+void vhw_timer_exit(void);
+
+/* set while debugfs "capture" is open */
+extern bool vhw_capture_on;
+
+void vhw_capture_init(void);
+void vhw_capture_exit(void);
+void __vhw_capture(int dir, int type, int id, uint32_t val, uint32_t arg, u64 ns);
+
+/*
+ * @bref capture one record, nearly free while nobody captures
+ *
+ * @param dir VHW_CAPTURE_RX or VHW_CAPTURE_TX
+ * @param type VHW_REC_* or 0 for raw data
+ * @param ns ktime_get_ns() when received or sent
+ */
+static inline void vhw_capture(int dir, int type, int id, uint32_t val, uint32_t arg, u64 ns)
+{
+    if (unlikely(READ_ONCE(vhw_capture_on)))
+        __vhw_capture(dir, type, id, val, arg, ns);
+}
+
+/* log2 latency histograms exported through debugfs */
+enum {
+    VHW_HIST_RX_DISPATCH,   /* packet received -> handler called */
+    VHW_HIST_SUBMIT_SEND,   /* event submitted -> handed to the transport */
+    VHW_HIST_SUBMIT_ACK,    /* record submitted -> acknowledged by the board */
+    VHW_HIST_CTRL_SEND,     /* control lane, event submitted -> handed to the transport */
+    VHW_HIST_BULK_SEND,     /* bulk lane, event submitted -> handed to the transport */
+    VHW_HIST_TIMER_JITTER,  /* timer expiry -> timer thread running */
+
+    VHW_HIST_MAX
+};
+
+#define VHW_HIST_BUCKETS        32
+
+/* "vhw" directory in debugfs, NULL without debugfs */
+extern struct dentry *vhw_debugfs_root;
+
+int vhw_debugfs_init(void);
+void vhw_debugfs_exit(void);
+
+/*
+ * @bref account one latency sample
+ *
+ * @param hist VHW_HIST_* histogram
+ * @param ns latency in nanoseconds
+ */
+void vhw_hist_add(int hist, u64 ns);
+
+/*
+ * @bref run the IRQ handler registered with the id
+ *
+ * @param rx_ns ktime_get_ns() when the event was received
+ */
+void vhw_irq_dispatch(int id, int val, u64 rx_ns);
+
+/*
+ * @bref handle one received record
+ */
+void vhw_recv_rec(const struct vhw_frame_rec *rec, u64 rx_ns);
+
+/*
+ * @bref handle one received datagram from a socket callback, it reads the
+ *       records straight from the skb and dispatches them without sleeping
+ *
+ * @param skb received datagram
+ * @param offset payload offset in "skb"
+ * @param rx_seq next frame sequence expected from this source, updated
+ *
+ * @return false if the datagram needs a thread, DMA fragments and
+ *         acknowledges take mutexes, it is left untouched then
+ */
+bool vhw_recv_skb(struct sk_buff *skb, int offset, uint32_t *rx_seq);
+
+/*
+ * @bref handle one received datagram, binary frame or legacy text
+ *
+ * @param buf datagram, it must have room for one more byte
+ * @param len datagram size
+ * @param rx_seq next frame sequence expected from this source, updated
+ */
+void vhw_recv_packet(char *buf, int len, uint32_t *rx_seq);
+
+#endif /* _VHW_PRIV_H_ */
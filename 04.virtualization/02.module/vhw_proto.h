@@ -0,0 +1,116 @@
+#ifndef _VHW_PROTO_H_
+#define _VHW_PROTO_H_
+
+#include <linux/types.h>
+
+/*
+ * virtual hardware wire protocol, shared by the kernel and the board
+ *
+ * every datagram is a frame header followed by "count" fixed size records,
+ * all fields are big endian:
+ *
+ *   +-------+---------+-------+-------+----------+-----+
+ *   | magic | version | flags | count | reserved | seq |  12 bytes
+ *   +-------+---------+-------+-------+----------+-----+
+ *   | type  |   id    |      val      |      arg       |  12 bytes * count
+ *   +-------+---------+---------------+----------------+
+ *
+ * the kernel may listen on several UDP ports (module parameter "rx_queues"),
+ * a board sends the records of IRQ "id" to port VHW_UDP_PORT + id % rx_queues
+ * and keeps one frame sequence per port, so the events of one IRQ are always
+ * received in order by the same queue
+ *
+ * a frame with the VHW_FRAME_F_RELIABLE flag is part of the reliable
+ * record stream from the kernel, "seq" is the sequence of its first record
+ * and every record takes one. the board only accepts the records in order
+ * and answers each frame with a VHW_REC_ACK record, the kernel sends them
+ * again when they aren't acknowledged in time. VHW_FRAME_F_RESYNC tells
+ * the board to restart at "seq" after the kernel gave up on some records
+ *
+ * a frame with the VHW_FRAME_F_DMA flag carries no record but one DMA
+ * fragment, a "struct vhw_dma_frag" followed by "len" bytes of data:
+ *
+ *   +------+-------+------+-----+--------+-------+-----+----------+
+ *   | chan | flags | xfer | seq | offset | total | len | reserved |  24 bytes
+ *   +------+-------+------+-----+--------+-------+-----+----------+
+ *   | data                                                         |  len bytes
+ *   +--------------------------------------------------------------+
+ *
+ * the receiver of fragments answers with VHW_REC_DMA_ACK records, the
+ * sequence of DMA frames is the one of the fragment, the frame sequence is
+ * unused. a board sends the fragments of channel "chan" to the port of
+ * IRQ "chan"
+ *
+ * a datagram which doesn't start with the magic is handled as the legacy
+ * format: "%04d%04d" text (value, id) from the board and host endian
+ * int[3] (type, gpio, state) to the board
+ */
+
+/* "VH" */
+#define VHW_PROTO_MAGIC         0x5648
+#define VHW_PROTO_VERSION       1
+
+/* maximum UDP payload which fits into an ethernet frame */
+#define VHW_FRAME_SIZE_MAX      1472
+
+/* frame header flags */
+#define VHW_FRAME_F_DMA         (1 << 0)    /* one DMA fragment instead of records */
+#define VHW_FRAME_F_RELIABLE    (1 << 1)    /* records to acknowledge */
+#define VHW_FRAME_F_RESYNC      (1 << 2)    /* the reliable stream restarts at "seq" */
+
+enum {
+    VHW_REC_GPIO = 1,   /* kernel -> board, id: gpio number, val: state */
+    VHW_REC_IRQ,        /* board -> kernel, id: IRQ id, val: IRQ value */
+    VHW_REC_GPIO_MULTI, /* kernel -> board, id: first gpio number, val: mask of the
+                           gpios to set, arg: their states, applied all at once */
+    VHW_REC_DMA_ACK,    /* both ways, id: DMA channel, val: next fragment sequence expected,
+                           arg: number of fragments accepted from that sequence on */
+    VHW_REC_ACK,        /* board -> kernel, val: next reliable record sequence expected,
+                           arg: number of records accepted from that sequence on */
+
+    VHW_REC_TYPE_MAX
+};
+
+struct vhw_frame_hdr {
+    __be16                  magic;
+    __u8                    version;
+    __u8                    flags;
+    __be16                  count;
+    __be16                  reserved;
+    __be32                  seq;
+};
+
+struct vhw_frame_rec {
+    __be16                  type;
+    __be16                  id;
+    __be32                  val;
+    __be32                  arg;
+};
+
+/* number of DMA channels */
+#define VHW_DMA_CHAN_MAX        8
+
+/* DMA fragment flags */
+#define VHW_DMA_FRAG_FIRST      (1 << 0)    /* first fragment of a transfer */
+#define VHW_DMA_FRAG_LAST       (1 << 1)    /* last fragment of a transfer */
+
+struct vhw_dma_frag {
+    __be16                  chan;
+    __be16                  flags;
+    __be32                  xfer;       /* transfer id */
+    __be32                  seq;        /* fragment sequence of the channel */
+    __be32                  offset;     /* offset of the data in the transfer */
+    __be32                  total;      /* length of the transfer */
+    __be16                  len;        /* data length of this fragment */
+    __be16                  reserved;
+};
+
+/* maximum data carried by one DMA fragment */
+#define VHW_DMA_FRAG_DATA_MAX \
+    (VHW_FRAME_SIZE_MAX - sizeof(struct vhw_frame_hdr) - sizeof(struct vhw_dma_frag))
+
+/* maximum number of records carried by one frame */
+#define VHW_FRAME_REC_MAX \
+    ((VHW_FRAME_SIZE_MAX - sizeof(struct vhw_frame_hdr)) / sizeof(struct vhw_frame_rec))
+
+#endif /* _VHW_PROTO_H_ */
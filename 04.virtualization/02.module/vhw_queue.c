@@ -0,0 +1,145 @@
+#include <linux/atomic.h>
+#include <linux/percpu.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/seq_file.h>
+#include <linux/log2.h>
+#include <linux/errno.h>
+
+#include "vhw_priv.h"
+
+/*
+ * bounded multi-producer single-consumer queue
+ *
+ * every slot has a sequence number: "pos" when it is free for the producer
+ * reserving position "pos", "pos + 1" when the event in it is published and
+ * "pos + size" again after the consumer took it out. producers reserve
+ * positions with a cmpxchg on "tail", the single consumer owns "head", no
+ * lock is taken on either side.
+ */
+
+int vhw_queue_init(struct vhw_queue *queue, const char *name, unsigned int size)
+{
+    unsigned int i;
+
+    if (!size || !is_power_of_2(size))
+        return -EINVAL;
+
+    queue->slots = vzalloc(size * sizeof(*queue->slots));
+    if (!queue->slots)
+        return -ENOMEM;
+
+    queue->stats = alloc_percpu(struct vhw_queue_stats);
+    if (!queue->stats) {
+        vfree(queue->slots);
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < size; i++)
+        atomic_set(&queue->slots[i].seq, i);
+
+    queue->name = name;
+    queue->size = size;
+    queue->head = 0;
+    atomic_set(&queue->tail, 0);
+    init_waitqueue_head(&queue->space_wq);
+
+    return 0;
+}
+
+void vhw_queue_free(struct vhw_queue *queue)
+{
+    free_percpu(queue->stats);
+    vfree(queue->slots);
+}
+
+bool vhw_queue_push(struct vhw_queue *queue, const struct vhw_event *event)
+{
+    int diff;
+    unsigned int pos, old;
+    struct vhw_queue_slot *slot;
+
+    pos = atomic_read(&queue->tail);
+    for (;;) {
+        slot = &queue->slots[pos & (queue->size - 1)];
+        diff = (int)(atomic_read_acquire(&slot->seq) - pos);
+
+        if (!diff) {
+            old = atomic_cmpxchg(&queue->tail, pos, pos + 1);
+            if (old == pos)
+                break;
+            pos = old;
+        } else if (diff < 0) {
+            /* the consumer hasn't freed this slot yet */
+            this_cpu_inc(queue->stats->full);
+            return false;
+        } else {
+            pos = atomic_read(&queue->tail);
+        }
+    }
+
+    slot->event = *event;
+    atomic_set_release(&slot->seq, pos + 1);
+
+    this_cpu_inc(queue->stats->enqueued);
+
+    return true;
+}
+
+bool vhw_queue_peek(struct vhw_queue *queue, struct vhw_event *event)
+{
+    struct vhw_queue_slot *slot = &queue->slots[queue->head & (queue->size - 1)];
+
+    if (atomic_read_acquire(&slot->seq) != queue->head + 1)
+        return false;
+
+    *event = slot->event;
+
+    return true;
+}
+
+void vhw_queue_skip(struct vhw_queue *queue)
+{
+    struct vhw_queue_slot *slot = &queue->slots[queue->head & (queue->size - 1)];
+
+    atomic_set_release(&slot->seq, queue->head + queue->size);
+    WRITE_ONCE(queue->head, queue->head + 1);
+
+    if (wq_has_sleeper(&queue->space_wq))
+        wake_up(&queue->space_wq);
+}
+
+bool vhw_queue_empty(struct vhw_queue *queue)
+{
+    struct vhw_queue_slot *slot = &queue->slots[queue->head & (queue->size - 1)];
+
+    return atomic_read_acquire(&slot->seq) != queue->head + 1;
+}
+
+unsigned int vhw_queue_len(struct vhw_queue *queue)
+{
+    /* reserved positions are counted even when they aren't published yet */
+    return (unsigned int)atomic_read(&queue->tail) - READ_ONCE(queue->head);
+}
+
+bool vhw_queue_has_space(struct vhw_queue *queue)
+{
+    return vhw_queue_len(queue) < queue->size;
+}
+
+void vhw_queue_show(struct seq_file *m, struct vhw_queue *queue)
+{
+    int cpu;
+    struct vhw_queue_stats sum = { 0 };
+
+    for_each_possible_cpu(cpu) {
+        struct vhw_queue_stats *stats = per_cpu_ptr(queue->stats, cpu);
+
+        sum.enqueued += stats->enqueued;
+        sum.dropped += stats->dropped;
+        sum.full += stats->full;
+    }
+
+    seq_printf(m, "%s: size %u depth %u enqueued %llu dropped %llu full %llu\n", queue->name,
+               queue->size, vhw_queue_len(queue), sum.enqueued, sum.dropped, sum.full);
+}
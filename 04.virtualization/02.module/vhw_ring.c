@@ -0,0 +1,287 @@
+#include <linux/fs.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/poll.h>
+#include <linux/eventfd.h>
+#include <linux/kthread.h>
+#include <linux/mutex.h>
+#include <linux/atomic.h>
+#include <linux/errno.h>
+#include <linux/err.h>
+#include <linux/ratelimit.h>
+#include <linux/ktime.h>
+#include <linux/moduleparam.h>
+#include <linux/module.h>
+#include <asm/barrier.h>
+#include <asm/byteorder.h>
+
+#include "vhw_priv.h"
+#include "vhw_ring.h"
+
+#define VHW_RING_MASK (VHW_RING_SIZE - 1)
+
+/* send raw data and DMA fragments with the UDP transport, they aren't records */
+static bool ring_udp = true;
+
+module_param(ring_udp, bool, S_IRUGO);
+
+static void *ring_area;
+static struct vhw_ring *tx_ring, *rx_ring;
+static struct task_struct *ring_task;
+static DECLARE_WAIT_QUEUE_HEAD(ring_rx_wq);
+static DECLARE_WAIT_QUEUE_HEAD(ring_poll_wq);
+static DEFINE_MUTEX(eventfd_mutex);
+static struct eventfd_ctx *tx_eventfd;
+/* the open file and every mapping of the rings */
+static atomic_t ring_users = ATOMIC_INIT(0);
+/* the UDP transport is up */
+static bool ring_udp_on;
+
+static bool vhw_ring_rx_pending(void)
+{
+    return READ_ONCE(rx_ring->head) != rx_ring->tail;
+}
+
+static int vhw_ring_entry(void *p)
+{
+    while (!kthread_should_stop()) {
+        u64 rx_ns;
+        uint32_t head, tail;
+
+        wait_event_interruptible(ring_rx_wq, vhw_ring_rx_pending() || kthread_should_stop());
+
+        rx_ns = ktime_get_ns();
+        head = smp_load_acquire(&rx_ring->head);
+        tail = rx_ring->tail;
+
+        /* "head" is written by the user, don't trust it */
+        if (head - tail > VHW_RING_SIZE) {
+            printk_ratelimited("ring head %u error, tail is %u\n", head, tail);
+            smp_store_release(&rx_ring->tail, head);
+            continue;
+        }
+
+        while (tail != head) {
+            struct vhw_frame_rec rec = rx_ring->rec[tail & VHW_RING_MASK];
+
+            vhw_recv_rec(&rec, rx_ns);
+            tail++;
+        }
+
+        smp_store_release(&rx_ring->tail, tail);
+    }
+
+    return 0;
+}
+
+static int vhw_ring_send(struct kvec *vec, int cnt, size_t len)
+{
+    int i;
+    uint32_t head, tail;
+    const struct vhw_frame_hdr *hdr = vec[0].iov_base;
+
+    /* the rings only carry records */
+    if (vec[0].iov_len != sizeof(*hdr) || ntohs(hdr->magic) != VHW_PROTO_MAGIC ||
+        (hdr->flags & VHW_FRAME_F_DMA)) {
+        if (ring_udp_on)
+            return vhw_udp_transport.send(vec, cnt, len);
+
+        printk_ratelimited("ring can't send %zu bytes which aren't records, ring_udp is off\n", len);
+        return -EPROTONOSUPPORT;
+    }
+
+    head = tx_ring->head;
+    tail = smp_load_acquire(&tx_ring->tail);
+    if (head - tail + (cnt - 1) > VHW_RING_SIZE)
+        return -ENOBUFS;
+
+    /* every other kvec holds exactly one record */
+    for (i = 1; i < cnt; i++)
+        memcpy(&tx_ring->rec[head++ & VHW_RING_MASK], vec[i].iov_base, sizeof(struct vhw_frame_rec));
+
+    smp_store_release(&tx_ring->head, head);
+
+    wake_up_interruptible(&ring_poll_wq);
+
+    mutex_lock(&eventfd_mutex);
+    if (tx_eventfd)
+        eventfd_signal(tx_eventfd, 1);
+    mutex_unlock(&eventfd_mutex);
+
+    return 0;
+}
+
+static int vhw_ring_set_eventfd(int fd)
+{
+    struct eventfd_ctx *ctx = NULL, *old;
+
+    if (fd >= 0) {
+        ctx = eventfd_ctx_fdget(fd);
+        if (IS_ERR(ctx))
+            return PTR_ERR(ctx);
+    }
+
+    mutex_lock(&eventfd_mutex);
+    old = tx_eventfd;
+    tx_eventfd = ctx;
+    mutex_unlock(&eventfd_mutex);
+
+    if (old)
+        eventfd_ctx_put(old);
+
+    return 0;
+}
+
+static int vhw_ring_open(struct inode *pnode, struct file *pfile)
+{
+    /*
+     * both rings are single producer single consumer, allow one board only,
+     * the mappings of a closed file still count
+     */
+    if (atomic_cmpxchg(&ring_users, 0, 1))
+        return -EBUSY;
+
+    return 0;
+}
+
+static int vhw_ring_release(struct inode *pnode, struct file *pfile)
+{
+    vhw_ring_set_eventfd(-1);
+    atomic_dec(&ring_users);
+
+    return 0;
+}
+
+static void vhw_ring_vma_open(struct vm_area_struct *vma)
+{
+    atomic_inc(&ring_users);
+}
+
+static void vhw_ring_vma_close(struct vm_area_struct *vma)
+{
+    atomic_dec(&ring_users);
+}
+
+static const struct vm_operations_struct vhw_ring_vm_ops = {
+    .open = vhw_ring_vma_open,
+    .close = vhw_ring_vma_close,
+};
+
+static int vhw_ring_mmap(struct file *pfile, struct vm_area_struct *vma)
+{
+    int ret;
+
+    if (vma->vm_pgoff || vma->vm_end - vma->vm_start > VHW_RING_MMAP_SIZE(PAGE_SIZE))
+        return -EINVAL;
+
+    ret = remap_vmalloc_range(vma, ring_area, 0);
+    if (ret)
+        return ret;
+
+    vma->vm_ops = &vhw_ring_vm_ops;
+    vhw_ring_vma_open(vma);
+
+    return 0;
+}
+
+static long vhw_ring_ioctl(struct file *pfile, unsigned int cmd, unsigned long arg)
+{
+    switch (cmd) {
+    case VHW_RING_IOC_SET_EVENTFD:
+        return vhw_ring_set_eventfd((int)arg);
+    case VHW_RING_IOC_KICK:
+        wake_up(&ring_rx_wq);
+        return 0;
+    default:
+        return -ENOTTY;
+    }
+}
+
+static unsigned int vhw_ring_poll(struct file *pfile, struct poll_table_struct *poll_table)
+{
+    unsigned int mask = 0;
+
+    poll_wait(pfile, &ring_poll_wq, poll_table);
+
+    if (READ_ONCE(tx_ring->head) != READ_ONCE(tx_ring->tail))
+        mask |= POLLIN | POLLRDNORM;
+
+    return mask;
+}
+
+static const struct file_operations vhw_ring_fops = {
+    .owner = THIS_MODULE,
+    .open = vhw_ring_open,
+    .release = vhw_ring_release,
+    .mmap = vhw_ring_mmap,
+    .unlocked_ioctl = vhw_ring_ioctl,
+    .poll = vhw_ring_poll,
+};
+
+static struct miscdevice vhw_ring_dev = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = "vhw_ring",
+    .fops = &vhw_ring_fops,
+};
+
+static int vhw_ring_init(void)
+{
+    int ret;
+
+    ring_area = vmalloc_user(VHW_RING_MMAP_SIZE(PAGE_SIZE));
+    if (!ring_area)
+        return -ENOMEM;
+
+    tx_ring = ring_area + VHW_RING_TX_OFFSET(PAGE_SIZE);
+    rx_ring = ring_area + VHW_RING_RX_OFFSET(PAGE_SIZE);
+
+    /* the rings still work without it, only records can be sent then */
+    if (ring_udp) {
+        ret = vhw_udp_transport.init();
+        if (ret)
+            printk("ring UDP transport error %d, raw data and DMA are off\n", ret);
+        ring_udp_on = !ret;
+    }
+
+    ret = misc_register(&vhw_ring_dev);
+    if (ret)
+        goto misc_fail;
+
+    ring_task = kthread_run(vhw_ring_entry, NULL, "vhw_ring");
+    if (IS_ERR(ring_task)) {
+        ret = PTR_ERR(ring_task);
+        goto thread_fail;
+    }
+
+    return 0;
+
+thread_fail:
+    printk("ring thread fail\n");
+    misc_deregister(&vhw_ring_dev);
+misc_fail:
+    printk("ring device fail\n");
+    if (ring_udp_on)
+        vhw_udp_transport.exit();
+    ring_udp_on = false;
+    vfree(ring_area);
+    return ret;
+}
+
+static void vhw_ring_exit(void)
+{
+    kthread_stop(ring_task);
+    misc_deregister(&vhw_ring_dev);
+    vhw_ring_set_eventfd(-1);
+    if (ring_udp_on)
+        vhw_udp_transport.exit();
+    ring_udp_on = false;
+    vfree(ring_area);
+}
+
+const struct vhw_transport vhw_ring_transport = {
+    .name = "ring",
+    .init = vhw_ring_init,
+    .exit = vhw_ring_exit,
+    .send = vhw_ring_send,
+};
@@ -0,0 +1,62 @@
+#ifndef _VHW_RING_H_
+#define _VHW_RING_H_
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#include "vhw_proto.h"
+
+/*
+ * shared memory transport, loaded with "transport=ring"
+ *
+ * the board maps VHW_RING_MMAP_SIZE(page size) bytes of VHW_RING_DEV, it
+ * holds two single producer single consumer rings of "struct vhw_frame_rec",
+ * each one starts on a page:
+ *
+ *   VHW_RING_TX_OFFSET(page size) : kernel -> board, GPIO records
+ *   VHW_RING_RX_OFFSET(page size) : board -> kernel, IRQ records
+ *
+ * "head" is only written by the producer and "tail" only by the consumer,
+ * both count up freely and are masked with VHW_RING_SIZE - 1. the producer
+ * stores its records before it stores "head" with release semantics and the
+ * consumer loads "head" with acquire semantics, "tail" works the same way.
+ *
+ * the kernel signals the eventfd set with VHW_RING_IOC_SET_EVENTFD and
+ * wakes up poll() when it produces records, the board calls
+ * VHW_RING_IOC_KICK when it produces records.
+ *
+ * raw data and DMA fragments don't fit into records, the kernel sends them
+ * with the UDP transport, which also receives the DMA acknowledges. the
+ * records carry no sequence, so the "reliable" module parameter is ignored.
+ *
+ * one board at a time, the device can be opened again once the previous
+ * board closed it and unmapped the rings.
+ */
+
+#define VHW_RING_DEV            "/dev/vhw_ring"
+
+/* records of one ring, power of 2 */
+#define VHW_RING_SIZE           1024
+
+struct vhw_ring {
+    __u32                   head;
+    __u32                   reserved1[15];
+    __u32                   tail;
+    __u32                   reserved2[15];
+    struct vhw_frame_rec    rec[VHW_RING_SIZE];
+};
+
+/* space of one ring, whole pages of the kernel, user space passes sysconf(_SC_PAGESIZE) */
+#define VHW_RING_AREA(page_size) \
+    ((sizeof(struct vhw_ring) + (page_size) - 1) & ~((unsigned long)(page_size) - 1))
+
+#define VHW_RING_TX_OFFSET(page_size)   0
+#define VHW_RING_RX_OFFSET(page_size)   VHW_RING_AREA(page_size)
+#define VHW_RING_MMAP_SIZE(page_size)   (2 * VHW_RING_AREA(page_size))
+
+#define VHW_RING_IOC_MAGIC          'V'
+/* argument is an eventfd, -1 removes it */
+#define VHW_RING_IOC_SET_EVENTFD    _IOW(VHW_RING_IOC_MAGIC, 1, int)
+#define VHW_RING_IOC_KICK           _IO(VHW_RING_IOC_MAGIC, 2)
+
+#endif /* _VHW_RING_H_ */
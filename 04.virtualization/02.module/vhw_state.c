@@ -0,0 +1,134 @@
+#include <linux/fs.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/spinlock.h>
+#include <linux/bitops.h>
+#include <linux/errno.h>
+#include <linux/module.h>
+#include <asm/barrier.h>
+
+#include "vhw_priv.h"
+#include "vhw_state.h"
+
+/*
+ * board state mirror, "seq" and "irq_seq" are seqcounts living in the shared
+ * page, the readers are in userspace. the GPIO writers are serialized by
+ * "state_lock", the writers of one IRQ id by its own lock, so the receive
+ * queues only meet when they dispatch the same id
+ */
+
+static struct vhw_state *vhw_state;
+static DEFINE_SPINLOCK(state_lock);
+static spinlock_t irq_lock[VHW_STATE_IRQ_MAX];
+
+static void vhw_state_write_begin(uint32_t *seq)
+{
+    WRITE_ONCE(*seq, *seq + 1);
+    smp_wmb();
+}
+
+static void vhw_state_write_end(uint32_t *seq)
+{
+    smp_wmb();
+    WRITE_ONCE(*seq, *seq + 1);
+}
+
+void vhw_state_gpio(int base, uint32_t mask, uint32_t value, u64 ns)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&state_lock, flags);
+    vhw_state_write_begin(&vhw_state->seq);
+
+    while (mask) {
+        int bit = __ffs(mask);
+        int gpio = base + bit;
+
+        mask &= mask - 1;
+
+        if (gpio < 0 || gpio >= VHW_STATE_GPIO_MAX)
+            continue;
+
+        if (value & BIT(bit))
+            vhw_state->gpio[gpio / 32] |= BIT(gpio % 32);
+        else
+            vhw_state->gpio[gpio / 32] &= ~BIT(gpio % 32);
+    }
+
+    WRITE_ONCE(vhw_state->update_ns, ns);
+    vhw_state_write_end(&vhw_state->seq);
+    spin_unlock_irqrestore(&state_lock, flags);
+}
+
+void vhw_state_irq(int id, int val, u64 ns)
+{
+    unsigned long flags;
+
+    if (id < 0 || id >= VHW_STATE_IRQ_MAX)
+        return;
+
+    spin_lock_irqsave(&irq_lock[id], flags);
+    vhw_state_write_begin(&vhw_state->irq_seq[id]);
+
+    vhw_state->irq_val[id] = val;
+    vhw_state->irq_count[id]++;
+    vhw_state->irq_ns[id] = ns;
+
+    vhw_state_write_end(&vhw_state->irq_seq[id]);
+    spin_unlock_irqrestore(&irq_lock[id], flags);
+}
+
+static int vhw_state_mmap(struct file *pfile, struct vm_area_struct *vma)
+{
+    if (vma->vm_pgoff || vma->vm_end - vma->vm_start > VHW_STATE_SIZE(PAGE_SIZE))
+        return -EINVAL;
+
+    /* only the kernel writes the mirror */
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+    vma->vm_flags &= ~VM_MAYWRITE;
+
+    return remap_vmalloc_range(vma, vhw_state, 0);
+}
+
+static const struct file_operations vhw_state_fops = {
+    .owner = THIS_MODULE,
+    .mmap = vhw_state_mmap,
+};
+
+static struct miscdevice vhw_state_dev = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = "vhw_state",
+    .fops = &vhw_state_fops,
+};
+
+int vhw_state_init(void)
+{
+    int i;
+    int ret;
+
+    BUILD_BUG_ON(VHW_IRQ_ID_MAX >= VHW_STATE_IRQ_MAX);
+
+    for (i = 0; i < VHW_STATE_IRQ_MAX; i++)
+        spin_lock_init(&irq_lock[i]);
+
+    vhw_state = vmalloc_user(VHW_STATE_SIZE(PAGE_SIZE));
+    if (!vhw_state)
+        return -ENOMEM;
+
+    ret = misc_register(&vhw_state_dev);
+    if (ret) {
+        printk("state device fail\n");
+        vfree(vhw_state);
+        return ret;
+    }
+
+    return 0;
+}
+
+void vhw_state_exit(void)
+{
+    misc_deregister(&vhw_state_dev);
+    vfree(vhw_state);
+}
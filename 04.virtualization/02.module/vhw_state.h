@@ -0,0 +1,49 @@
+#ifndef _VHW_STATE_H_
+#define _VHW_STATE_H_
+
+#include <linux/types.h>
+
+/*
+ * board state mirror, a monitor maps VHW_STATE_SIZE(page size) bytes of VHW_STATE_DEV
+ * read-only and samples the whole board without a system call
+ *
+ * the kernel updates the GPIO states when their records are sent and the
+ * IRQ values when they are received. "seq" is odd while an update of the
+ * GPIO states is in progress, a consistent snapshot is taken like a
+ * seqcount reader does:
+ *
+ *   do {
+ *       while ((seq = __atomic_load_n(&state->seq, __ATOMIC_ACQUIRE)) & 1)
+ *           ;
+ *       memcpy(copy.gpio, state->gpio, sizeof(copy.gpio));
+ *       __atomic_thread_fence(__ATOMIC_ACQUIRE);
+ *   } while (seq != __atomic_load_n(&state->seq, __ATOMIC_RELAXED));
+ *
+ * the IRQs of different ids are received on several CPUs at once, so every
+ * IRQ id has a seqcount of its own, "irq_seq[id]" guards "irq_val[id]",
+ * "irq_count[id]" and "irq_ns[id]" the same way
+ */
+
+#define VHW_STATE_DEV           "/dev/vhw_state"
+
+/* GPIO numbers mirrored */
+#define VHW_STATE_GPIO_MAX      256
+/* IRQ ids mirrored, more than the highest IRQ id */
+#define VHW_STATE_IRQ_MAX       128
+
+struct vhw_state {
+    __u32                   seq;
+    __u32                   reserved;
+    __u64                   update_ns;                          /* ktime_get_ns() of the last GPIO update */
+    __u32                   gpio[VHW_STATE_GPIO_MAX / 32];      /* bit N of word W is GPIO W * 32 + N */
+    __s32                   irq_val[VHW_STATE_IRQ_MAX];         /* last value of each IRQ id */
+    __u32                   irq_count[VHW_STATE_IRQ_MAX];       /* IRQs received of each id */
+    __u32                   irq_seq[VHW_STATE_IRQ_MAX];         /* seqcount of each IRQ id */
+    __u64                   irq_ns[VHW_STATE_IRQ_MAX];          /* ktime_get_ns() of the last IRQ of each id */
+};
+
+/* whole pages of the kernel, user space passes sysconf(_SC_PAGESIZE) */
+#define VHW_STATE_SIZE(page_size) \
+    ((sizeof(struct vhw_state) + (page_size) - 1) & ~((unsigned long)(page_size) - 1))
+
+#endif /* _VHW_STATE_H_ */
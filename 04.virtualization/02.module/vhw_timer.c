@@ -0,0 +1,294 @@
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/uaccess.h>
+#include <linux/string.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/moduleparam.h>
+#include <linux/module.h>
+#include <linux/errno.h>
+#include <linux/err.h>
+
+#include "vhw.h"
+#include "vhw_priv.h"
+
+/*
+ * virtual timer peripheral
+ *
+ * every running timer is a thread sleeping on an absolute hrtimer, at each
+ * expiry it raises its IRQ id like a received IRQ record, the value is the
+ * number of periods elapsed since the last one. a periodic timer which
+ * wakes up more than one period late counts the missed periods as overruns
+ * and keeps its original phase
+ */
+
+/* hrtimer slack of the timer threads, 0 is the most precise */
+static unsigned long timer_slack_ns;
+
+module_param(timer_slack_ns, ulong, S_IRUGO | S_IWUSR);
+
+struct vhw_timer_stats {
+    u64                     fires;
+    u64                     overruns;
+    u64                     jitter_min;
+    u64                     jitter_max;
+    u64                     jitter_sum;
+};
+
+struct vhw_timer {
+    int                     id;         /* IRQ id raised, -1 when free */
+    u64                     period_ns;
+    bool                    periodic;
+    /* cleared by a one-shot expiry, set again by vhw_timer_start() */
+    bool                    armed;
+    /* vhw_timer_stop() is waiting for the thread, the slot isn't free yet */
+    bool                    stopping;
+    u64                     next_ns;
+    struct task_struct      *task;
+    struct vhw_timer_stats  stats;
+};
+
+static struct vhw_timer vhw_timers[VHW_TIMER_MAX];
+static DEFINE_MUTEX(timer_mutex);
+static struct dentry *timer_dentry;
+
+static int vhw_timer_entry(void *p)
+{
+    struct vhw_timer *timer = p;
+    struct vhw_timer_stats *stats = &timer->stats;
+
+    while (!kthread_should_stop()) {
+        u64 now;
+        u64 jitter;
+        u64 missed = 0;
+        ktime_t expires;
+
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (kthread_should_stop()) {
+            __set_current_state(TASK_RUNNING);
+            break;
+        }
+
+        /* pairs with vhw_timer_start(), the period is set before */
+        if (!smp_load_acquire(&timer->armed)) {
+            schedule();
+            continue;
+        }
+
+        expires = ns_to_ktime(timer->next_ns);
+        schedule_hrtimeout_range(&expires, READ_ONCE(timer_slack_ns), HRTIMER_MODE_ABS);
+
+        now = ktime_get_ns();
+        /* woken up by kthread_stop() */
+        if (now < timer->next_ns)
+            continue;
+
+        jitter = now - timer->next_ns;
+        if (timer->periodic) {
+            missed = div64_u64(jitter, timer->period_ns);
+            timer->next_ns += (missed + 1) * timer->period_ns;
+        } else {
+            /* before the handler, so it can start the timer again */
+            WRITE_ONCE(timer->armed, false);
+        }
+
+        stats->fires++;
+        stats->overruns += missed;
+        stats->jitter_sum += jitter;
+        if (stats->fires == 1 || jitter < stats->jitter_min)
+            stats->jitter_min = jitter;
+        if (jitter > stats->jitter_max)
+            stats->jitter_max = jitter;
+        vhw_hist_add(VHW_HIST_TIMER_JITTER, jitter);
+
+        /* it is a board peripheral, captures and replays see it as received */
+        vhw_capture(VHW_CAPTURE_RX, VHW_REC_IRQ, timer->id, missed + 1, 0, now);
+        vhw_irq_dispatch(timer->id, missed + 1, now);
+    }
+
+    return 0;
+}
+
+static struct vhw_timer *vhw_timer_find(int id)
+{
+    int i;
+
+    for (i = 0; i < VHW_TIMER_MAX; i++) {
+        if (vhw_timers[i].id == id)
+            return &vhw_timers[i];
+    }
+
+    return NULL;
+}
+
+int vhw_timer_start(int id, u64 period_ns, bool periodic)
+{
+    int ret = 0;
+    struct vhw_timer *timer;
+
+    if (id < 0 || id > VHW_IRQ_ID_MAX || period_ns < VHW_TIMER_PERIOD_MIN)
+        return -EINVAL;
+
+    mutex_lock(&timer_mutex);
+
+    timer = vhw_timer_find(id);
+    if (timer && timer->stopping) {
+        ret = -ESHUTDOWN;
+        goto out;
+    }
+    if (timer && timer->armed) {
+        ret = -EBUSY;
+        goto out;
+    }
+
+    /* an expired one-shot timer keeps its thread */
+    if (!timer) {
+        timer = vhw_timer_find(-1);
+        if (!timer) {
+            ret = -ENOSPC;
+            goto out;
+        }
+
+        memset(&timer->stats, 0, sizeof(timer->stats));
+        timer->armed = false;
+
+        timer->task = kthread_run(vhw_timer_entry, timer, "vhw_timer%d", id);
+        if (IS_ERR(timer->task)) {
+            ret = PTR_ERR(timer->task);
+            printk("timer %d thread fail\n", id);
+            goto out;
+        }
+
+        timer->id = id;
+    }
+
+    timer->period_ns = period_ns;
+    timer->periodic = periodic;
+    timer->next_ns = ktime_get_ns() + period_ns;
+    smp_store_release(&timer->armed, true);
+    wake_up_process(timer->task);
+
+out:
+    mutex_unlock(&timer_mutex);
+
+    return ret;
+}
+EXPORT_SYMBOL(vhw_timer_start);
+
+void vhw_timer_stop(int id)
+{
+    struct vhw_timer *timer;
+
+    mutex_lock(&timer_mutex);
+    timer = vhw_timer_find(id);
+    if (!timer || timer->stopping) {
+        mutex_unlock(&timer_mutex);
+        return;
+    }
+    timer->stopping = true;
+    mutex_unlock(&timer_mutex);
+
+    /* without the mutex, the handler may be in vhw_timer_start() */
+    kthread_stop(timer->task);
+
+    mutex_lock(&timer_mutex);
+    timer->stopping = false;
+    timer->id = -1;
+    mutex_unlock(&timer_mutex);
+}
+EXPORT_SYMBOL(vhw_timer_stop);
+
+static int vhw_timer_show(struct seq_file *m, void *v)
+{
+    int i;
+
+    seq_printf(m, "%4s %12s %8s %12s %10s %10s %10s %10s\n", "id", "period(ns)", "mode",
+               "fires", "overruns", "jmin(ns)", "javg(ns)", "jmax(ns)");
+
+    mutex_lock(&timer_mutex);
+    for (i = 0; i < VHW_TIMER_MAX; i++) {
+        struct vhw_timer *timer = &vhw_timers[i];
+        struct vhw_timer_stats *stats = &timer->stats;
+
+        if (timer->id < 0)
+            continue;
+
+        seq_printf(m, "%4d %12llu %8s %12llu %10llu %10llu %10llu %10llu\n", timer->id,
+                   timer->period_ns, !timer->periodic ? "oneshot" : "periodic", stats->fires,
+                   stats->overruns, stats->jitter_min,
+                   stats->fires ? div64_u64(stats->jitter_sum, stats->fires) : 0, stats->jitter_max);
+    }
+    mutex_unlock(&timer_mutex);
+
+    return 0;
+}
+
+static int vhw_timer_open(struct inode *pnode, struct file *pfile)
+{
+    return single_open(pfile, vhw_timer_show, NULL);
+}
+
+/* "start <id> <period_ns> [oneshot]" or "stop <id>" */
+static ssize_t vhw_timer_write(struct file *pfile, const char __user *pbuf, size_t size, loff_t *off)
+{
+    int ret;
+    int id;
+    unsigned long long period_ns;
+    char cmd[64];
+    char mode[16] = "";
+
+    if (size >= sizeof(cmd))
+        return -EINVAL;
+
+    if (copy_from_user(cmd, pbuf, size))
+        return -EFAULT;
+    cmd[size] = '\0';
+
+    if (sscanf(cmd, "start %d %llu %15s", &id, &period_ns, mode) >= 2) {
+        ret = vhw_timer_start(id, period_ns, strcmp(mode, "oneshot"));
+        if (ret)
+            return ret;
+    } else if (sscanf(cmd, "stop %d", &id) == 1) {
+        vhw_timer_stop(id);
+    } else {
+        return -EINVAL;
+    }
+
+    return size;
+}
+
+static const struct file_operations vhw_timer_fops = {
+    .owner = THIS_MODULE,
+    .open = vhw_timer_open,
+    .read = seq_read,
+    .write = vhw_timer_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+void vhw_timer_init(void)
+{
+    int i;
+
+    for (i = 0; i < VHW_TIMER_MAX; i++)
+        vhw_timers[i].id = -1;
+
+    if (vhw_debugfs_root)
+        timer_dentry = debugfs_create_file("timer", S_IRUGO | S_IWUSR, vhw_debugfs_root, NULL,
+                                           &vhw_timer_fops);
+}
+
+void vhw_timer_exit(void)
+{
+    int i;
+
+    debugfs_remove(timer_dentry);
+
+    for (i = 0; i < VHW_TIMER_MAX; i++) {
+        if (vhw_timers[i].id >= 0)
+            vhw_timer_stop(vhw_timers[i].id);
+    }
+}
@@ -0,0 +1,127 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM vhw
+
+#if !defined(_VHW_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _VHW_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+/* a datagram is received */
+TRACE_EVENT(vhw_rx_packet,
+
+    TP_PROTO(int len),
+
+    TP_ARGS(len),
+
+    TP_STRUCT__entry(
+        __field(int,            len)
+    ),
+
+    TP_fast_assign(
+        __entry->len = len;
+    ),
+
+    TP_printk("len=%d", __entry->len)
+);
+
+/* a received datagram is decoded, "seq" is 0 for the legacy text */
+TRACE_EVENT(vhw_rx_decode,
+
+    TP_PROTO(bool frame, u32 seq, int count),
+
+    TP_ARGS(frame, seq, count),
+
+    TP_STRUCT__entry(
+        __field(bool,           frame)
+        __field(u32,            seq)
+        __field(int,            count)
+    ),
+
+    TP_fast_assign(
+        __entry->frame = frame;
+        __entry->seq = seq;
+        __entry->count = count;
+    ),
+
+    TP_printk("format=%s seq=%u count=%d",
+              __entry->frame ? "frame" : "text", __entry->seq, __entry->count)
+);
+
+/* an IRQ is handed to its handler, or to its work item when deferred */
+TRACE_EVENT(vhw_irq_dispatch,
+
+    TP_PROTO(int id, int val, bool found, bool deferred),
+
+    TP_ARGS(id, val, found, deferred),
+
+    TP_STRUCT__entry(
+        __field(int,            id)
+        __field(int,            val)
+        __field(bool,           found)
+        __field(bool,           deferred)
+    ),
+
+    TP_fast_assign(
+        __entry->id = id;
+        __entry->val = val;
+        __entry->found = found;
+        __entry->deferred = deferred;
+    ),
+
+    TP_printk("id=%d val=%d found=%d deferred=%d",
+              __entry->id, __entry->val, __entry->found, __entry->deferred)
+);
+
+/* an event is put into the transmit FIFO */
+TRACE_EVENT(vhw_tx_enqueue,
+
+    TP_PROTO(int type, int len, int ret),
+
+    TP_ARGS(type, len, ret),
+
+    TP_STRUCT__entry(
+        __field(int,            type)
+        __field(int,            len)
+        __field(int,            ret)
+    ),
+
+    TP_fast_assign(
+        __entry->type = type;
+        __entry->len = len;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("type=%s len=%d ret=%d",
+              __print_symbolic(__entry->type, { 0, "raw" }, { 1, "record" }, { 2, "legacy" }),
+              __entry->len, __entry->ret)
+);
+
+/* a batch of events is handed to the transport */
+TRACE_EVENT(vhw_tx_send,
+
+    TP_PROTO(int count, size_t len, int ret),
+
+    TP_ARGS(count, len, ret),
+
+    TP_STRUCT__entry(
+        __field(int,            count)
+        __field(size_t,         len)
+        __field(int,            ret)
+    ),
+
+    TP_fast_assign(
+        __entry->count = count;
+        __entry->len = len;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("count=%d len=%zu ret=%d", __entry->count, __entry->len, __entry->ret)
+);
+
+#endif /* _VHW_TRACE_H_ */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE vhw_trace
+#include <trace/define_trace.h>
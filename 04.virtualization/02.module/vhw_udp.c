@@ -0,0 +1,543 @@
+#include <linux/net.h>
+#include <linux/inet.h>
+#include <linux/in.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/cpumask.h>
+#include <linux/slab.h>
+#include <linux/errno.h>
+#include <linux/err.h>
+#include <linux/uio.h>
+#include <linux/moduleparam.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/skbuff.h>
+#include <linux/wait.h>
+#include <linux/string.h>
+#include <linux/module.h>
+#include <net/sock.h>
+#include <net/udp.h>
+
+#include "vhw_priv.h"
+
+/* packet rate of a receive queue is measured over this time */
+#define VHW_POLL_WINDOW_NS      (10 * NSEC_PER_MSEC)
+
+struct vhw_rx_stats {
+    u64                     packets;
+    u64                     wakeups;        /* blocking receives */
+    u64                     polled;         /* packets taken by polling */
+    u64                     budget_out;     /* poll rounds which used up the budget */
+    u64                     enter_poll;
+    u64                     exit_poll;
+    u64                     callback;       /* packets handled in the socket callback */
+    u64                     backlog;        /* packets the socket callback gave to the thread */
+};
+
+struct vhw_rx_queue {
+    int                     index;
+    struct socket           *socket;
+    struct task_struct      *task;
+    struct sockaddr_in      sockaddr;
+    uint32_t                rx_seq;
+
+    bool                    polling;
+    u64                     window_start;
+    u64                     window_packets;
+    struct vhw_rx_stats     stats;
+
+    /* only used by the "callback" receive mode */
+    spinlock_t              rx_lock;
+    struct sk_buff_head     backlog;
+    /* datagrams given to the thread and not handled yet, the later ones wait behind them */
+    atomic_t                backlog_len;
+    wait_queue_head_t       backlog_wq;
+    void (*data_ready)(struct sock *sk);
+
+    char                    buf[VHW_FRAME_SIZE_MAX + 1];
+};
+
+/* number of receive queues, each one has its own socket and thread */
+static unsigned int rx_queues = 1;
+/* CPU of every receive queue thread, -1 lets the scheduler pick it */
+static int rx_cpus[VHW_RX_QUEUE_MAX] = { [0 ... VHW_RX_QUEUE_MAX - 1] = -1 };
+static int rx_cpus_num;
+
+/*
+ * adaptive polling like NAPI: above "poll_enter_rate" packets per second a
+ * queue stops sleeping for every datagram and drains up to "poll_budget"
+ * datagrams per round, busy polling "poll_idle_us" when the socket is empty,
+ * below "poll_exit_rate" it goes back to blocking receives, 0 disables it
+ */
+static unsigned int poll_enter_rate;
+static unsigned int poll_exit_rate;
+static unsigned int poll_budget = 64;
+static unsigned int poll_idle_us = 20;
+
+/*
+ * "thread" receives every datagram in the queue thread, "callback" handles
+ * them in the socket callback in softirq context and only gives the thread
+ * the ones which sleep, see vhw_recv_skb(), and the ones which arrive while
+ * the thread has some
+ */
+static char *rx_mode = "thread";
+static bool rx_callback;
+
+module_param(rx_queues, uint, S_IRUGO);
+module_param_array(rx_cpus, int, &rx_cpus_num, S_IRUGO);
+module_param(poll_enter_rate, uint, S_IRUGO | S_IWUSR);
+module_param(poll_exit_rate, uint, S_IRUGO | S_IWUSR);
+module_param(poll_budget, uint, S_IRUGO | S_IWUSR);
+module_param(poll_idle_us, uint, S_IRUGO | S_IWUSR);
+module_param(rx_mode, charp, S_IRUGO);
+
+static struct vhw_rx_queue *queues;
+static struct dentry *udp_dentry;
+/* queue 0 also sends to the board */
+static struct socket *main_socket;
+
+static int vhw_rx_one(struct vhw_rx_queue *queue, int flags)
+{
+    int ret;
+    struct kvec vec = {
+        .iov_base = queue->buf,
+        .iov_len = VHW_FRAME_SIZE_MAX
+    };
+    struct msghdr msg = {
+        .msg_name = &queue->sockaddr,
+        .msg_namelen = sizeof(queue->sockaddr),
+        .msg_control = NULL,
+        .msg_controllen = 0,
+        .msg_flags = 0
+    };
+
+    ret = kernel_recvmsg(queue->socket, &msg, &vec, 1, VHW_FRAME_SIZE_MAX, flags);
+    if (ret > 0) {
+        vhw_recv_packet(queue->buf, ret, &queue->rx_seq);
+        queue->stats.packets++;
+        queue->window_packets++;
+    }
+
+    return ret;
+}
+
+/*
+ * @return number of packets, -EAGAIN if nothing came in "poll_idle_us" and
+ *         0 or other error if the socket is closed
+ */
+static int vhw_rx_poll(struct vhw_rx_queue *queue)
+{
+    int ret;
+    int n = 0;
+    u64 idle_start = 0;
+    unsigned int budget = max(READ_ONCE(poll_budget), 1U);
+
+    while (n < budget) {
+        u64 now;
+
+        ret = vhw_rx_one(queue, MSG_DONTWAIT);
+        if (ret > 0) {
+            queue->stats.polled++;
+            idle_start = 0;
+            n++;
+            continue;
+        } else if (ret != -EAGAIN) {
+            return n ? n : ret;
+        }
+
+        now = ktime_get_ns();
+        if (!idle_start)
+            idle_start = now;
+        if (now - idle_start >= (u64)READ_ONCE(poll_idle_us) * NSEC_PER_USEC || need_resched())
+            return n ? n : -EAGAIN;
+
+        cpu_relax();
+    }
+
+    queue->stats.budget_out++;
+
+    return n;
+}
+
+static void vhw_rx_rate_update(struct vhw_rx_queue *queue)
+{
+    u64 rate;
+    u64 now = ktime_get_ns();
+    u64 elapsed = now - queue->window_start;
+    unsigned int enter_rate = READ_ONCE(poll_enter_rate);
+    unsigned int exit_rate = READ_ONCE(poll_exit_rate);
+
+    if (elapsed < VHW_POLL_WINDOW_NS)
+        return;
+
+    rate = div64_u64(queue->window_packets * NSEC_PER_SEC, elapsed);
+
+    if (!queue->polling && enter_rate && rate >= enter_rate) {
+        queue->polling = true;
+        queue->stats.enter_poll++;
+    } else if (queue->polling && (!enter_rate || rate < exit_rate)) {
+        queue->polling = false;
+        queue->stats.exit_poll++;
+    }
+
+    queue->window_start = now;
+    queue->window_packets = 0;
+}
+
+static int vhw_main_entry(void *p)
+{
+    int ret;
+    struct vhw_rx_queue *queue = p;
+
+    queue->window_start = ktime_get_ns();
+
+    while (!kthread_should_stop()) {
+        ret = -EAGAIN;
+
+        if (queue->polling) {
+            ret = vhw_rx_poll(queue);
+            /* give the CPU away between two rounds like NAPI does */
+            if (ret > 0)
+                cond_resched();
+        }
+
+        /* nothing to poll, sleep until the next datagram */
+        if (ret == -EAGAIN) {
+            ret = vhw_rx_one(queue, 0);
+            queue->stats.wakeups++;
+        }
+
+        if (ret <= 0) {
+            printk("queue %d receive error %d\n", queue->index, ret);
+            break;
+        }
+
+        vhw_rx_rate_update(queue);
+    }
+
+    /* the socket is shut down, but kthread_stop() expects the thread to be alive */
+    set_current_state(TASK_INTERRUPTIBLE);
+    while (!kthread_should_stop()) {
+        schedule();
+        set_current_state(TASK_INTERRUPTIBLE);
+    }
+    __set_current_state(TASK_RUNNING);
+
+    printk("queue %d thread exit\n", queue->index);
+
+    return 0;
+}
+
+/* the socket callback, called in softirq context after a datagram is queued */
+static void vhw_rx_data_ready(struct sock *sk)
+{
+    int err;
+    struct sk_buff *skb;
+    struct vhw_rx_queue *queue;
+
+    read_lock(&sk->sk_callback_lock);
+
+    queue = sk->sk_user_data;
+    if (!queue)
+        goto out;
+
+    /* two CPUs may queue datagrams at once, keep them in order */
+    spin_lock(&queue->rx_lock);
+    while ((skb = skb_recv_udp(sk, 0, 1, &err))) {
+        queue->stats.packets++;
+
+        if (udp_lib_checksum_complete(skb)) {
+            kfree_skb(skb);
+            continue;
+        }
+
+        /* the UDP header is already pulled, nothing overtakes a datagram in the backlog */
+        if (!atomic_read(&queue->backlog_len) && vhw_recv_skb(skb, 0, &queue->rx_seq)) {
+            queue->stats.callback++;
+            consume_skb(skb);
+        } else {
+            queue->stats.backlog++;
+            atomic_inc(&queue->backlog_len);
+            skb_queue_tail(&queue->backlog, skb);
+        }
+    }
+    spin_unlock(&queue->rx_lock);
+
+    if (!skb_queue_empty(&queue->backlog))
+        wake_up(&queue->backlog_wq);
+
+out:
+    read_unlock(&sk->sk_callback_lock);
+}
+
+/* the thread of the "callback" receive mode, it handles the datagrams which sleep */
+static int vhw_backlog_entry(void *p)
+{
+    int len;
+    struct sk_buff *skb;
+    struct vhw_rx_queue *queue = p;
+
+    while (!kthread_should_stop()) {
+        wait_event_interruptible(queue->backlog_wq,
+                                 !skb_queue_empty(&queue->backlog) || kthread_should_stop());
+
+        while ((skb = skb_dequeue(&queue->backlog))) {
+            len = min_t(int, skb->len, VHW_FRAME_SIZE_MAX);
+            /* "rx_seq" is shared with the callback, it is only used for a warning */
+            if (!skb_copy_bits(skb, 0, queue->buf, len))
+                vhw_recv_packet(queue->buf, len, &queue->rx_seq);
+            consume_skb(skb);
+            atomic_dec(&queue->backlog_len);
+        }
+    }
+
+    printk("queue %d thread exit\n", queue->index);
+
+    return 0;
+}
+
+static void vhw_rx_callback_set(struct vhw_rx_queue *queue)
+{
+    struct sock *sk = queue->socket->sk;
+
+    write_lock_bh(&sk->sk_callback_lock);
+    queue->data_ready = sk->sk_data_ready;
+    sk->sk_user_data = queue;
+    sk->sk_data_ready = vhw_rx_data_ready;
+    write_unlock_bh(&sk->sk_callback_lock);
+
+    /* datagrams which came in before */
+    local_bh_disable();
+    vhw_rx_data_ready(sk);
+    local_bh_enable();
+}
+
+static void vhw_rx_callback_restore(struct vhw_rx_queue *queue)
+{
+    struct sock *sk = queue->socket->sk;
+
+    write_lock_bh(&sk->sk_callback_lock);
+    sk->sk_data_ready = queue->data_ready;
+    sk->sk_user_data = NULL;
+    write_unlock_bh(&sk->sk_callback_lock);
+}
+
+static int vhw_udp_show(struct seq_file *m, void *v)
+{
+    int i;
+
+    seq_printf(m, "%5s %5s %12s %12s %12s %12s %10s %10s %12s %12s\n", "queue", "mode", "packets",
+               "wakeups", "polled", "budget_out", "enter_poll", "exit_poll", "callback", "backlog");
+
+    for (i = 0; i < rx_queues; i++) {
+        struct vhw_rx_queue *queue = &queues[i];
+        const char *mode = rx_callback ? "cb" : READ_ONCE(queue->polling) ? "poll" : "block";
+
+        seq_printf(m, "%5d %5s %12llu %12llu %12llu %12llu %10llu %10llu %12llu %12llu\n", i,
+                   mode, queue->stats.packets, queue->stats.wakeups, queue->stats.polled,
+                   queue->stats.budget_out, queue->stats.enter_poll, queue->stats.exit_poll,
+                   queue->stats.callback, queue->stats.backlog);
+    }
+
+    return 0;
+}
+
+static int vhw_udp_open(struct inode *pnode, struct file *pfile)
+{
+    return single_open(pfile, vhw_udp_show, NULL);
+}
+
+static const struct file_operations vhw_udp_fops = {
+    .owner = THIS_MODULE,
+    .open = vhw_udp_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static int vhw_udp_send(struct kvec *vec, int cnt, size_t n)
+{
+    int ret;
+    struct sockaddr_in sockaddr;
+    struct msghdr msg = {
+        .msg_name = &sockaddr,
+        .msg_namelen = sizeof(sockaddr),
+        .msg_control = NULL,
+        .msg_controllen = 0,
+        .msg_flags = 0
+    };
+    
+    memset(&sockaddr, 0, sizeof(sockaddr));
+    sockaddr.sin_family = PF_INET;
+    sockaddr.sin_addr.s_addr = in_aton(VHW_GROUP);
+    sockaddr.sin_port = htons(VHW_UDP_PORT);
+
+    ret = kernel_sendmsg(main_socket, &msg, vec, cnt, n);
+    if (ret <= 0) {
+        printk("send message error %d, segments is %d, len is %zu\n", ret, cnt, n);
+        return ret ? ret : -EIO;
+    }
+    
+    return 0;
+}
+
+/*
+ * every queue binds its own port: multicast datagrams are copied to every
+ * socket sharing a port even with SO_REUSEPORT, so a shared port would
+ * deliver each event rx_queues times
+ */
+static int vhw_udp_socket(struct socket **psocket, int port)
+{
+    int ret;
+    int loop;
+    struct socket *socket;
+    struct ip_mreq mreq;
+    struct sockaddr_in sockaddr;
+
+    ret = sock_create(PF_INET, SOCK_DGRAM, 0, &socket);
+    if (ret)
+        goto create_fail;
+
+    memset(&sockaddr, 0, sizeof(sockaddr));
+    sockaddr.sin_family = PF_INET;
+    sockaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    sockaddr.sin_port = htons(port);
+    ret = kernel_bind(socket, (struct sockaddr *)&sockaddr, sizeof(sockaddr));
+    if (ret)
+        goto bind_fail;
+
+    loop = 0;
+    ret = kernel_setsockopt(socket, IPPROTO_IP, IP_MULTICAST_LOOP, (char *)&loop, sizeof(loop));
+    if (ret)
+        goto setopt_fail1;
+
+    mreq.imr_multiaddr.s_addr = in_aton(VHW_GROUP);
+    mreq.imr_interface.s_addr = htons(INADDR_ANY);
+    ret = kernel_setsockopt(socket, IPPROTO_IP, IP_ADD_MEMBERSHIP, (char *)&mreq, sizeof(mreq));
+    if (ret)
+        goto setopt_fail2;
+
+    *psocket = socket;
+
+    return 0;
+
+setopt_fail2:
+    printk("enbale multicase error\n");
+setopt_fail1:
+    printk("disable multicase loop back error\n");
+bind_fail:
+    printk("release socket %p\n", socket);
+    sock_release(socket);
+create_fail:
+    printk("create socket of port %d error %d\n", port, ret);
+    return ret;
+}
+
+static int vhw_rx_queue_start(struct vhw_rx_queue *queue)
+{
+    int ret;
+    int cpu = rx_cpus[queue->index];
+
+    ret = vhw_udp_socket(&queue->socket, VHW_UDP_PORT + queue->index);
+    if (ret)
+        return ret;
+
+    spin_lock_init(&queue->rx_lock);
+    skb_queue_head_init(&queue->backlog);
+    atomic_set(&queue->backlog_len, 0);
+    init_waitqueue_head(&queue->backlog_wq);
+
+    queue->task = kthread_create(rx_callback ? vhw_backlog_entry : vhw_main_entry, queue,
+                                 "virtual_board%d", queue->index + 1);
+    if (IS_ERR(queue->task)) {
+        ret = PTR_ERR(queue->task);
+        printk("queue %d thread fail\n", queue->index);
+        sock_release(queue->socket);
+        return ret;
+    }
+
+    if (cpu >= 0 && cpu < nr_cpu_ids && cpu_online(cpu))
+        kthread_bind(queue->task, cpu);
+    else if (cpu >= 0)
+        printk("queue %d CPU %d is offline\n", queue->index, cpu);
+
+    wake_up_process(queue->task);
+
+    if (rx_callback)
+        vhw_rx_callback_set(queue);
+
+    return 0;
+}
+
+static void vhw_rx_queue_stop(struct vhw_rx_queue *queue)
+{
+    if (rx_callback)
+        vhw_rx_callback_restore(queue);
+
+    kernel_sock_shutdown(queue->socket, SHUT_RDWR);
+    kthread_stop(queue->task);
+    skb_queue_purge(&queue->backlog);
+    sock_release(queue->socket);
+}
+
+static int vhw_udp_init(void)
+{
+    int i;
+    int ret;
+
+    rx_queues = clamp_t(unsigned int, rx_queues, 1, VHW_RX_QUEUE_MAX);
+
+    if (!strcmp(rx_mode, "callback")) {
+        rx_callback = true;
+    } else if (strcmp(rx_mode, "thread")) {
+        printk("receive mode %s error\n", rx_mode);
+        return -EINVAL;
+    }
+
+    queues = kcalloc(rx_queues, sizeof(*queues), GFP_KERNEL);
+    if (!queues)
+        return -ENOMEM;
+
+    for (i = 0; i < rx_queues; i++) {
+        queues[i].index = i;
+
+        ret = vhw_rx_queue_start(&queues[i]);
+        if (ret)
+            goto queue_fail;
+    }
+
+    main_socket = queues[0].socket;
+
+    if (vhw_debugfs_root)
+        udp_dentry = debugfs_create_file("udp", S_IRUGO, vhw_debugfs_root, NULL, &vhw_udp_fops);
+
+    return 0;
+
+queue_fail:
+    while (--i >= 0)
+        vhw_rx_queue_stop(&queues[i]);
+    kfree(queues);
+    return ret;
+}
+
+static void vhw_udp_exit(void)
+{
+    int i;
+
+    debugfs_remove(udp_dentry);
+
+    for (i = 0; i < rx_queues; i++)
+        vhw_rx_queue_stop(&queues[i]);
+
+    main_socket = NULL;
+    kfree(queues);
+}
+
+const struct vhw_transport vhw_udp_transport = {
+    .name = "udp",
+    .init = vhw_udp_init,
+    .exit = vhw_udp_exit,
+    .send = vhw_udp_send,
+};
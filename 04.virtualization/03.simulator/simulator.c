@@ -0,0 +1,671 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "vhw_proto.h"
+#include "vhw_ring.h"
+
+/**
+ * headless virtual board, it speaks the vhw multicast protocol like board.py
+ * but emulates many keys and LEDs and presses the keys at a fixed rate.
+ *
+ * pressing key "key_base + n" is expected to toggle LED "n", which is what
+ * 03.devices/01.character/test.c does, the time between sending the key and
+ * receiving the LED is the round trip latency.
+ *
+ * run it on another host than the kernel, the kernel disables multicast
+ * loop back, for example:
+ *
+ *   ./simulator -k 4 -r 10000 -d 10
+ *
+ * with "-R" it runs on the kernel host instead and exchanges the records
+ * through the shared memory rings of the "ring" transport, load the module
+ * with transport=ring, for example:
+ *
+ *   ./simulator -R -k 4 -r 10000 -d 10
+ */
+
+#define VHW_UDP_PORT        14212
+#define VHW_GROUP           "224.0.2.66"
+
+#define SIM_PENDING_MAX     256
+#define SIM_LATENCY_MAX     (4 * 1024 * 1024)
+#define SIM_QUEUE_MAX       16
+/* records the kernel may send before an acknowledge in reliable mode */
+#define SIM_RELIABLE_WINDOW 1024
+
+struct sim_config {
+    const char              *group;
+    int                     port;
+    int                     queues;
+    int                     key_base;
+    int                     keys;
+    unsigned int            rate;
+    unsigned int            count;
+    unsigned int            duration;
+    unsigned int            batch;
+    unsigned int            drain_ms;
+    bool                    text;
+    bool                    ring;
+    bool                    verbose;
+};
+
+/* press times of one key waiting for their LED */
+struct sim_key {
+    uint64_t                pending[SIM_PENDING_MAX];
+    unsigned int            head;
+    unsigned int            tail;
+};
+
+struct sim_stats {
+    uint64_t                keys_sent;
+    uint64_t                frames_sent;
+    uint64_t                send_errors;
+    uint64_t                leds_received;
+    uint64_t                frames_received;
+    uint64_t                unmatched;
+    uint64_t                overflows;
+};
+
+static struct sim_config config = {
+    .group = VHW_GROUP,
+    .port = VHW_UDP_PORT,
+    .queues = 1,
+    .key_base = 5,
+    .keys = 4,
+    .rate = 1000,
+    .count = 0,
+    .duration = 10,
+    .batch = 1,
+    .drain_ms = 1000,
+};
+
+static struct sim_key *keys;
+static bool *leds;
+static uint64_t *latency;
+static uint64_t latency_num;
+static struct sim_stats stats;
+static pthread_mutex_t sim_mutex = PTHREAD_MUTEX_INITIALIZER;
+static volatile bool running = true;
+static uint32_t tx_seq[SIM_QUEUE_MAX];
+/* the key thread and the acknowledges of the LED thread share the socket */
+static pthread_mutex_t send_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* next reliable record sequence expected from the kernel */
+static uint32_t rel_expect;
+/* rings of VHW_RING_DEV in ring mode */
+static struct vhw_ring *ring_tx;
+static struct vhw_ring *ring_rx;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns)
+{
+    struct timespec ts = {
+        .tv_sec = ns / 1000000000ULL,
+        .tv_nsec = ns % 1000000000ULL
+    };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static void key_pressed(int key, uint64_t ns)
+{
+    struct sim_key *k = &keys[key];
+
+    pthread_mutex_lock(&sim_mutex);
+    if (k->head - k->tail == SIM_PENDING_MAX) {
+        /* the LED never came back for the oldest press */
+        k->tail++;
+        stats.overflows++;
+    }
+    k->pending[k->head++ % SIM_PENDING_MAX] = ns;
+    stats.keys_sent++;
+    pthread_mutex_unlock(&sim_mutex);
+}
+
+static void led_changed(int led, bool state, uint64_t ns)
+{
+    struct sim_key *k;
+
+    if (led < 0 || led >= config.keys) {
+        stats.unmatched++;
+        return;
+    }
+
+    k = &keys[led];
+
+    pthread_mutex_lock(&sim_mutex);
+    leds[led] = state;
+    stats.leds_received++;
+    if (k->head == k->tail) {
+        stats.unmatched++;
+    } else {
+        uint64_t sent = k->pending[k->tail++ % SIM_PENDING_MAX];
+
+        if (latency_num < SIM_LATENCY_MAX)
+            latency[latency_num++] = ns - sent;
+    }
+    pthread_mutex_unlock(&sim_mutex);
+
+    if (config.verbose)
+        printf("LED %d state %d\n", led, state);
+}
+
+/* produce records into the board -> kernel ring and wake up the kernel */
+static int send_ring(int fd, const struct vhw_frame_rec *recs, int count)
+{
+    int i;
+    uint32_t head, tail;
+
+    head = ring_rx->head;
+    tail = __atomic_load_n(&ring_rx->tail, __ATOMIC_ACQUIRE);
+    if (head - tail + count > VHW_RING_SIZE) {
+        stats.send_errors++;
+        return -ENOBUFS;
+    }
+
+    for (i = 0; i < count; i++)
+        ring_rx->rec[head++ & (VHW_RING_SIZE - 1)] = recs[i];
+
+    __atomic_store_n(&ring_rx->head, head, __ATOMIC_RELEASE);
+
+    if (ioctl(fd, VHW_RING_IOC_KICK) < 0) {
+        stats.send_errors++;
+        return -errno;
+    }
+
+    stats.frames_sent++;
+
+    return 0;
+}
+
+static int send_frame(int fd, int queue, const struct vhw_frame_rec *recs, int count)
+{
+    int ret;
+    char buf[VHW_FRAME_SIZE_MAX];
+    struct vhw_frame_hdr *hdr = (struct vhw_frame_hdr *)buf;
+    struct sockaddr_in addr;
+
+    if (config.ring) {
+        pthread_mutex_lock(&send_mutex);
+        ret = send_ring(fd, recs, count);
+        pthread_mutex_unlock(&send_mutex);
+        return ret;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(config.group);
+    addr.sin_port = htons(config.port + queue);
+
+    pthread_mutex_lock(&send_mutex);
+
+    hdr->magic = htons(VHW_PROTO_MAGIC);
+    hdr->version = VHW_PROTO_VERSION;
+    hdr->flags = 0;
+    hdr->count = htons(count);
+    hdr->reserved = 0;
+    hdr->seq = htonl(tx_seq[queue]++);
+    memcpy(hdr + 1, recs, count * sizeof(*recs));
+
+    ret = sendto(fd, buf, sizeof(*hdr) + count * sizeof(*recs), 0,
+                 (struct sockaddr *)&addr, sizeof(addr));
+    if (ret < 0) {
+        ret = -errno;
+        stats.send_errors++;
+    } else {
+        ret = 0;
+        stats.frames_sent++;
+    }
+
+    pthread_mutex_unlock(&send_mutex);
+
+    return ret;
+}
+
+/* legacy "%04d%04d" text, value first and IRQ id last */
+static int send_text(int fd, int id, int val)
+{
+    int ret;
+    char buf[16];
+    struct sockaddr_in addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(config.group);
+    addr.sin_port = htons(config.port);
+
+    snprintf(buf, sizeof(buf), "%04d%04d", val, id);
+
+    ret = sendto(fd, buf, 8, 0, (struct sockaddr *)&addr, sizeof(addr));
+    if (ret < 0) {
+        stats.send_errors++;
+        return -errno;
+    }
+
+    stats.frames_sent++;
+
+    return 0;
+}
+
+static void *key_task(void *p)
+{
+    int fd = *(int *)p;
+    unsigned int seed = (unsigned int)now_ns();
+    uint64_t start = now_ns();
+    uint64_t next = start;
+    uint64_t period = 1000000000ULL * config.batch / config.rate;
+    uint64_t end = config.duration ? start + config.duration * 1000000000ULL : 0;
+    unsigned int sent = 0;
+
+    while (running) {
+        int i, q;
+        int counts[SIM_QUEUE_MAX] = { 0 };
+        struct vhw_frame_rec recs[SIM_QUEUE_MAX][VHW_FRAME_REC_MAX];
+
+        if (config.count && sent >= config.count)
+            break;
+        if (end && now_ns() >= end)
+            break;
+
+        for (i = 0; i < config.batch; i++) {
+            int key = rand_r(&seed) % config.keys;
+            int id = config.key_base + key;
+            struct vhw_frame_rec *rec;
+
+            if (config.count && sent >= config.count)
+                break;
+            sent++;
+
+            key_pressed(key, now_ns());
+
+            if (config.text) {
+                send_text(fd, id, 1);
+                continue;
+            }
+
+            /* the kernel receives IRQ "id" on port + id % queues */
+            q = id % config.queues;
+            rec = &recs[q][counts[q]++];
+            rec->type = htons(VHW_REC_IRQ);
+            rec->id = htons(id);
+            rec->val = htonl(1);
+            rec->arg = 0;
+        }
+
+        for (q = 0; q < config.queues; q++) {
+            if (counts[q])
+                send_frame(fd, q, recs[q], counts[q]);
+        }
+
+        next += period;
+        sleep_until(next);
+    }
+
+    return NULL;
+}
+
+/* acknowledge a reliable frame, it returns the first record not received yet */
+static int recv_reliable(int fd, const struct vhw_frame_hdr *hdr, int count)
+{
+    uint32_t seq = ntohl(hdr->seq);
+    uint32_t first = rel_expect - seq;
+    struct vhw_frame_rec ack;
+
+    if (hdr->flags & VHW_FRAME_F_RESYNC)
+        first = 0;
+
+    /* a gap, drop the frame and tell what is missing */
+    if (first > count)
+        first = count;
+    else
+        rel_expect = seq + count;
+
+    ack.type = htons(VHW_REC_ACK);
+    ack.id = 0;
+    ack.val = htonl(rel_expect);
+    ack.arg = htonl(SIM_RELIABLE_WINDOW);
+    send_frame(fd, 0, &ack, 1);
+
+    return first;
+}
+
+static void recv_rec(const struct vhw_frame_rec *rec, uint64_t ns)
+{
+    int bit;
+    int id = ntohs(rec->id);
+    uint32_t val = ntohl(rec->val);
+    uint32_t arg = ntohl(rec->arg);
+
+    switch (ntohs(rec->type)) {
+    case VHW_REC_GPIO:
+        led_changed(id, val, ns);
+        break;
+    case VHW_REC_GPIO_MULTI:
+        for (bit = 0; bit < 32; bit++) {
+            if (val & (1U << bit))
+                led_changed(id + bit, !!(arg & (1U << bit)), ns);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static void recv_frame(int fd, const char *buf, int len, uint64_t ns)
+{
+    int i;
+    int first = 0;
+    int count;
+    const struct vhw_frame_hdr *hdr = (const struct vhw_frame_hdr *)buf;
+    const struct vhw_frame_rec *rec = (const struct vhw_frame_rec *)(hdr + 1);
+
+    if (hdr->version != VHW_PROTO_VERSION)
+        return;
+
+    count = ntohs(hdr->count);
+    if (len < sizeof(*hdr) + count * sizeof(*rec))
+        return;
+
+    if (hdr->flags & VHW_FRAME_F_RELIABLE)
+        first = recv_reliable(fd, hdr, count);
+
+    for (i = first; i < count; i++)
+        recv_rec(&rec[i], ns);
+
+    /* our own key frames are looped back by this host, don't count them */
+    if (count && ntohs(rec[0].type) != VHW_REC_IRQ && ntohs(rec[0].type) != VHW_REC_ACK)
+        stats.frames_received++;
+}
+
+/* legacy host endian int[3] events, several of them when batched */
+static void recv_legacy(const char *buf, int len, uint64_t ns)
+{
+    int i;
+    int32_t event[3];
+
+    stats.frames_received++;
+
+    for (i = 0; i + sizeof(event) <= len; i += sizeof(event)) {
+        memcpy(event, buf + i, sizeof(event));
+        if (event[0] == VHW_REC_GPIO)
+            led_changed(event[1], event[2], ns);
+    }
+}
+
+static void *led_task(void *p)
+{
+    int fd = *(int *)p;
+    char buf[VHW_FRAME_SIZE_MAX];
+
+    while (running) {
+        int len;
+        uint64_t ns;
+        const struct vhw_frame_hdr *hdr = (const struct vhw_frame_hdr *)buf;
+
+        len = recv(fd, buf, sizeof(buf), 0);
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
+            printf("receive error %d\n", errno);
+            break;
+        }
+        ns = now_ns();
+
+        if (len >= sizeof(*hdr) && ntohs(hdr->magic) == VHW_PROTO_MAGIC)
+            recv_frame(fd, buf, len, ns);
+        else
+            recv_legacy(buf, len, ns);
+    }
+
+    return NULL;
+}
+
+/* consume the kernel -> board ring, poll() tells when it isn't empty */
+static void *ring_led_task(void *p)
+{
+    int fd = *(int *)p;
+    struct pollfd pfd = {
+        .fd = fd,
+        .events = POLLIN,
+    };
+
+    while (running) {
+        uint32_t head, tail;
+        uint64_t ns;
+
+        /* wake up now and then to see "running" */
+        if (poll(&pfd, 1, 100) < 0) {
+            if (errno == EINTR)
+                continue;
+            printf("poll error %d\n", errno);
+            break;
+        }
+        ns = now_ns();
+
+        tail = ring_tx->tail;
+        head = __atomic_load_n(&ring_tx->head, __ATOMIC_ACQUIRE);
+        if (head == tail)
+            continue;
+
+        stats.frames_received++;
+        while (tail != head)
+            recv_rec(&ring_tx->rec[tail++ & (VHW_RING_SIZE - 1)], ns);
+
+        __atomic_store_n(&ring_tx->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+static int open_ring(void)
+{
+    int fd;
+    long page_size = sysconf(_SC_PAGESIZE);
+    void *area;
+
+    fd = open(VHW_RING_DEV, O_RDWR);
+    if (fd < 0)
+        return -1;
+
+    area = mmap(NULL, VHW_RING_MMAP_SIZE(page_size), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (area == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    ring_tx = (struct vhw_ring *)((char *)area + VHW_RING_TX_OFFSET(page_size));
+    ring_rx = (struct vhw_ring *)((char *)area + VHW_RING_RX_OFFSET(page_size));
+
+    return fd;
+}
+
+static int open_socket(void)
+{
+    int fd;
+    int on = 1;
+    struct ip_mreq mreq;
+    struct sockaddr_in addr;
+    struct timeval timeout = {
+        .tv_sec = 0,
+        .tv_usec = 100000
+    };
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+        return -1;
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    /* wake up now and then to see "running" */
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(config.port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        goto fail;
+
+    mreq.imr_multiaddr.s_addr = inet_addr(config.group);
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+        goto fail;
+
+    return fd;
+
+fail:
+    close(fd);
+    return -1;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(double p)
+{
+    uint64_t i = (uint64_t)(p / 100.0 * (latency_num - 1) + 0.5);
+
+    return latency[i];
+}
+
+static void report(uint64_t elapsed)
+{
+    double seconds = elapsed / 1e9;
+
+    printf("elapsed           %.3f s\n", seconds);
+    printf("keys sent         %llu (%.0f/s)\n", (unsigned long long)stats.keys_sent, stats.keys_sent / seconds);
+    printf("frames sent       %llu, errors %llu\n", (unsigned long long)stats.frames_sent,
+           (unsigned long long)stats.send_errors);
+    printf("LEDs received     %llu (%.0f/s)\n", (unsigned long long)stats.leds_received,
+           stats.leds_received / seconds);
+    printf("frames received   %llu\n", (unsigned long long)stats.frames_received);
+    printf("unmatched LEDs    %llu, lost keys %llu\n", (unsigned long long)stats.unmatched,
+           (unsigned long long)(stats.overflows));
+
+    if (!latency_num) {
+        printf("no round trip measured\n");
+        return;
+    }
+
+    qsort(latency, latency_num, sizeof(*latency), cmp_u64);
+
+    printf("round trip (us)   min %.1f p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+           latency[0] / 1e3, percentile(50) / 1e3, percentile(90) / 1e3, percentile(99) / 1e3,
+           percentile(99.9) / 1e3, latency[latency_num - 1] / 1e3);
+}
+
+static void usage(const char *name)
+{
+    printf("usage: %s [options]\n", name);
+    printf("  -g group     multicast group, default %s\n", VHW_GROUP);
+    printf("  -p port      base UDP port, default %d\n", VHW_UDP_PORT);
+    printf("  -q queues    kernel receive queues (rx_queues), default 1\n");
+    printf("  -b base      IRQ id of the first key, default 5\n");
+    printf("  -k keys      number of keys and LEDs, default 4\n");
+    printf("  -r rate      key presses per second, default 1000\n");
+    printf("  -B batch     key presses per frame, default 1\n");
+    printf("  -n count     stop after this many key presses\n");
+    printf("  -d seconds   stop after this time, default 10, 0 runs forever\n");
+    printf("  -w ms        time to wait for the last LEDs, default 1000\n");
+    printf("  -t           send the legacy text format\n");
+    printf("  -R           use the shared memory rings of %s, on the kernel host\n", VHW_RING_DEV);
+    printf("  -v           print every LED change\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int c;
+    int fd;
+    uint64_t start, end;
+    pthread_t key_thread, led_thread;
+
+    while ((c = getopt(argc, argv, "g:p:q:b:k:r:B:n:d:w:tRvh")) != -1) {
+        switch (c) {
+        case 'g': config.group = optarg; break;
+        case 'p': config.port = atoi(optarg); break;
+        case 'q': config.queues = atoi(optarg); break;
+        case 'b': config.key_base = atoi(optarg); break;
+        case 'k': config.keys = atoi(optarg); break;
+        case 'r': config.rate = strtoul(optarg, NULL, 0); break;
+        case 'B': config.batch = strtoul(optarg, NULL, 0); break;
+        case 'n': config.count = strtoul(optarg, NULL, 0); break;
+        case 'd': config.duration = strtoul(optarg, NULL, 0); break;
+        case 'w': config.drain_ms = strtoul(optarg, NULL, 0); break;
+        case 't': config.text = true; break;
+        case 'R': config.ring = true; break;
+        case 'v': config.verbose = true; break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (config.queues < 1 || config.queues > SIM_QUEUE_MAX || config.keys < 1 || !config.rate ||
+        config.batch < 1 || config.batch > VHW_FRAME_REC_MAX || (config.ring && config.text)) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    keys = calloc(config.keys, sizeof(*keys));
+    leds = calloc(config.keys, sizeof(*leds));
+    latency = malloc(SIM_LATENCY_MAX * sizeof(*latency));
+    if (!keys || !leds || !latency) {
+        printf("no memory\n");
+        return -1;
+    }
+
+    if (config.ring) {
+        /* the rings have no queues */
+        config.queues = 1;
+        fd = open_ring();
+    } else {
+        fd = open_socket();
+    }
+    if (fd < 0) {
+        printf("open %s error %d\n", config.ring ? VHW_RING_DEV : "socket", errno);
+        return -1;
+    }
+
+    start = now_ns();
+
+    pthread_create(&led_thread, NULL, config.ring ? ring_led_task : led_task, &fd);
+    pthread_create(&key_thread, NULL, key_task, &fd);
+
+    pthread_join(key_thread, NULL);
+    end = now_ns();
+    usleep(config.drain_ms * 1000);
+    running = false;
+    pthread_join(led_thread, NULL);
+
+    report(end - start);
+
+    close(fd);
+
+    return 0;
+}